@@ -0,0 +1,48 @@
+// Whole-file compression in independent blocks on a pool of worker threads.
+
+#ifndef _BLOCK_PIPELINE_H_
+#define _BLOCK_PIPELINE_H_
+
+#define PIPELINE_BLOCK_SIZE (256 * 1024)
+#define PIPELINE_HEADER_SIZE 9      // Method, original size and stored size, sizes big-endian
+#define PIPELINE_MAX_WORKERS 64
+
+// The file is cut into PIPELINE_BLOCK_SIZE blocks, each compressed with lzhCompress()
+// or stored as it is when that does not shrink it. The stream sent is every block's
+// header followed by its stored bytes, in file order. Workers keep up to two blocks
+// each in flight, so compression runs ahead of the link.
+
+typedef struct BlockPipeline BlockPipeline;
+
+typedef struct {
+    long long originalBytes;
+    long long storedBytes;      // Headers included
+    int blocks;
+    int rawBlocks;              // Stored as they were
+    double workerSeconds;       // CPU time the workers spent on blocks
+    double stallSeconds;        // Time the link thread waited for a block
+} PipelineStatistics;
+
+// Transmitter: start compressing fileSize bytes read from fd with workers threads.
+// Return NULL on error.
+BlockPipeline *startCompression(int fd, long long fileSize, int workers);
+
+// Wait for the next block in file order and return it with its header in *size bytes.
+// Return NULL once every block was returned, or if a block could not be read.
+const unsigned char *nextBlock(BlockPipeline *pipeline, int *size);
+
+// Give back the block returned by nextBlock() so its slot takes a new one.
+void releaseBlock(BlockPipeline *pipeline);
+
+// Receiver: start decompressing into fd with workers threads. Return NULL on error.
+BlockPipeline *startDecompression(int fd, int workers);
+
+// Append size bytes of the stream. Each complete block goes to a worker, which writes
+// it at its place in the file. Return -1 if the stream is malformed.
+int feedBlocks(BlockPipeline *pipeline, const unsigned char *data, int size);
+
+// Wait for the workers, fill stats (may be NULL) and free the pipeline.
+// Return -1 if a block failed or the stream ended inside a block.
+int finishPipeline(BlockPipeline *pipeline, PipelineStatistics *stats);
+
+#endif // _BLOCK_PIPELINE_H_
@@ -0,0 +1,30 @@
+// Byte stuffing for flag-delimited frames.
+
+#ifndef _BYTE_STUFFING_H_
+#define _BYTE_STUFFING_H_
+
+#define STUFF_FLAG 0x7e
+#define STUFF_ESCAPE 0x7d
+#define STUFF_XOR 0x20
+
+// Copy size bytes from src to dst, replacing every FLAG or ESCAPE byte by
+// ESCAPE followed by the byte XOR 0x20. The XOR of the source bytes (BCC2)
+// is computed in the same pass and stored in *bcc.
+// dst must have room for 2 * size bytes and must not overlap src.
+// Return the number of bytes written to dst.
+int stuffBytes(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc);
+
+// Undo stuffBytes() in place on the size bytes of buf.
+// Return the new size, or -1 if an ESCAPE is last or not followed by an escaped FLAG/ESCAPE.
+int destuffBytes(unsigned char *buf, int size);
+
+// Destuff one chunk of a frame body that arrives in pieces, from src into dst
+// (dst may equal src). *escapePending carries an ESCAPE split across chunks and
+// must start at 0. Every destuffed byte is XORed into *check.
+// Return the number of bytes written, or -1 on an invalid escape sequence.
+int destuffChunk(unsigned char *dst, const unsigned char *src, int size, int *escapePending, unsigned char *check);
+
+// Name of the implementation picked for this CPU ("avx2", "sse2" or "scalar").
+const char *stuffingImplementation();
+
+#endif // _BYTE_STUFFING_H_
@@ -0,0 +1,31 @@
+// Consistent Overhead Byte Stuffing for flag-delimited frames.
+
+#ifndef _COBS_H_
+#define _COBS_H_
+
+#define COBS_DELIMITER 0x7e     // The byte that never appears in encoded data
+
+// The data is cut at every COBS_DELIMITER byte, and groups longer than 254 bytes are cut too.
+// Each group is sent as a code byte (group length + 1, XORed with COBS_DELIMITER so
+// it can never be the delimiter) followed by the group. The delimiter bytes themselves
+// are implied by the codes. size bytes take at most size + size / 254 + 1 bytes.
+
+// Encode size bytes of src into dst. Return the number of bytes written.
+int cobsEncode(unsigned char *dst, const unsigned char *src, int size);
+
+// Decoding runs chunk by chunk, the state carries a group across chunks.
+typedef struct {
+    int remaining;          // Group bytes still to copy, -1 when a code byte comes next
+    int delimiterPending;   // The group just finished implies a delimiter, unless the frame ends here
+} CobsDecoder;
+
+void cobsStart(CobsDecoder *decoder);
+
+// Decode size encoded bytes into dst (at most size bytes come out).
+// Return the number of bytes written, or -1 if src holds the delimiter.
+int cobsDecodeChunk(unsigned char *dst, const unsigned char *src, int size, CobsDecoder *decoder);
+
+// True when the data decoded so far ends on a group boundary, as a complete frame does.
+int cobsComplete(const CobsDecoder *decoder);
+
+#endif // _COBS_H_
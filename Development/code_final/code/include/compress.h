@@ -0,0 +1,19 @@
+// LZ4 block compression for data packets.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Blocks follow the LZ4 block format: sequences of literals and back references of
+// at least 4 bytes up to 65535 bytes back, the last 5 bytes always literal.
+// The format carries no sizes, the caller sends the original size along.
+
+// Compress size bytes of src into dst, which holds dstCapacity bytes.
+// Return the compressed size, or -1 if it would not be smaller than size:
+// the data should then be sent as it is.
+int compressBlock(unsigned char *dst, int dstCapacity, const unsigned char *src, int size);
+
+// Decompress size bytes of src into dst, which holds dstCapacity bytes.
+// Return the decompressed size, or -1 if the block is malformed or does not fit.
+int decompressBlock(unsigned char *dst, int dstCapacity, const unsigned char *src, int size);
+
+#endif // _COMPRESS_H_
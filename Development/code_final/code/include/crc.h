@@ -0,0 +1,26 @@
+// Cyclic redundancy checks for the I frame check sequence.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+// Both use the reflected HDLC polynomials (FCS-16 0x1021, FCS-32 0x04c11db7).
+// The functions only advance the register, so a frame can be checked piece by piece:
+// start from CRC16_INIT/CRC32_INIT and send the complement of the final value,
+// low byte first. Running the receiver's CRC over payload and FCS then ends in the
+// constant residue whatever the data.
+#define CRC16_INIT 0xffff
+#define CRC16_RESIDUE 0xf0b8
+#define CRC32_INIT 0xffffffffU
+#define CRC32_RESIDUE 0xdebb20e3U
+
+// Advance a CRC register over size bytes of data.
+unsigned short crc16Update(unsigned short crc, const unsigned char *data, int size);
+unsigned int crc32Update(unsigned int crc, const unsigned char *data, int size);
+
+// CRC-8 (polynomial 0x07, not reflected, initial 0), for short headers.
+unsigned char crc8Update(unsigned char crc, const unsigned char *data, int size);
+
+// Name of the CRC-32 implementation picked for this CPU ("pclmul" or "slice-by-8").
+const char *crcImplementation();
+
+#endif // _CRC_H_
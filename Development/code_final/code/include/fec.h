@@ -0,0 +1,23 @@
+// Reed-Solomon forward error correction over GF(256).
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#define FEC_MAX_PARITY 32   // Parity bytes per codeword, corrects half as many byte errors
+#define FEC_MAX_DEPTH 16    // Interleaved codewords per block
+
+// A block is size data bytes followed by depth * parity parity bytes.
+// Data byte i belongs to codeword i % depth, so a burst of up to depth bytes
+// costs each codeword a single error. Every codeword must fit in 255 bytes:
+// (size + depth - 1) / depth + parity <= 255.
+
+// Write the depth * parity parity bytes of the size bytes of data to parityOut.
+// Return the number of bytes written.
+int fecEncode(unsigned char *parityOut, const unsigned char *data, int size, int parity, int depth);
+
+// Correct the block in place.
+// Return the number of bytes corrected, or -1 if a codeword has too many errors
+// or would not fit in 255 bytes.
+int fecDecode(unsigned char *block, int size, int parity, int depth);
+
+#endif // _FEC_H_
@@ -0,0 +1,21 @@
+// Link layer: sending a file straight from its pages.
+// Implemented in link_layer.c next to llwrite(), link_layer.h itself stays as it was given.
+
+#ifndef _LINK_SENDFILE_H_
+#define _LINK_SENDFILE_H_
+
+#define LL_MAX_PACKET_HEADER 16     // Room header() gets for each frame
+
+// Write the packet header for the size file bytes at offset, which follow it in the same I frame.
+// Return the header size, at most LL_MAX_PACKET_HEADER, or -1 to stop.
+typedef int (*PacketHeader)(void *context, unsigned char *header, long long offset, int size);
+
+// Send length bytes of fileFd from offset in I frames carrying at most chunk file bytes each,
+// every one behind the header that header() writes for it. The file is mapped and each frame
+// is built from the mapped pages, so the bytes are not copied before the frame is encoded.
+// The file size is checked before each frame, and a SIGBUS from pages cut off while a frame
+// is built is caught on this thread, so a file that shrinks meanwhile fails the call instead
+// of killing the process. Return the number of file bytes sent, or -1 on error.
+long long llsendfile(int fileFd, long long offset, long long length, int chunk, PacketHeader header, void *context);
+
+#endif // _LINK_SENDFILE_H_
@@ -0,0 +1,21 @@
+// LZ77 with Huffman coding for large independent blocks.
+
+#ifndef _LZH_H_
+#define _LZH_H_
+
+#define LZH_MAX_BLOCK (1 << 22)     // Matches reach back at most this far
+
+// A block holds the code lengths of two Huffman alphabets, one for literals and
+// match lengths and one for match distances, then the coded sequence ended by
+// an end symbol. Matches are found through hash chains with one step of lazy
+// evaluation, so it trades speed for ratio where compressBlock() does the opposite.
+
+// Compress size bytes of src (at most LZH_MAX_BLOCK) into dst, which holds dstCapacity bytes.
+// Return the compressed size, or -1 if it would not be smaller than size.
+int lzhCompress(unsigned char *dst, int dstCapacity, const unsigned char *src, int size);
+
+// Decompress size bytes of src into dst, which holds dstCapacity bytes.
+// Return the decompressed size, or -1 if the block is malformed or does not fit.
+int lzhDecompress(unsigned char *dst, int dstCapacity, const unsigned char *src, int size);
+
+#endif // _LZH_H_
@@ -0,0 +1,54 @@
+// Packet ring: a bounded queue of fixed-size buffers from one producer thread to one consumer thread.
+
+#ifndef _PACKET_RING_H_
+#define _PACKET_RING_H_
+
+// The buffers are allocated once and used in turn. Handing a buffer over takes no lock:
+// each side moves its own counter and reads the other's. A side only takes the ring's
+// mutex to sleep when the ring is full (producer) or empty (consumer), and the other
+// side only takes it to wake a sleeper. The producer calls may come from more than one
+// thread as long as the caller keeps them from overlapping, with a mutex of its own.
+
+typedef struct PacketRing PacketRing;
+
+typedef struct {
+    long long buffers;          // Buffers handed over
+    int peak;                   // Most buffers queued at once
+    int fullWaits;              // Times the producer found the ring full
+    int emptyWaits;             // Times the consumer found it empty, once closed excluded
+    double fullSeconds;         // Time the producer waited for a free buffer
+    double emptySeconds;        // Time the consumer waited for a queued one
+} RingStatistics;
+
+// count buffers of size bytes each, every buffer aligned to alignment bytes when size is a
+// multiple of it (alignment a power of two, at least sizeof(void *)). Return NULL on error.
+PacketRing *createRing(int count, int size, int alignment);
+
+// Producer: the next free buffer, waiting while every buffer is queued.
+// Return NULL once the consumer has aborted.
+unsigned char *ringReserve(PacketRing *ring);
+
+// Producer: queue the buffer from ringReserve() with size bytes and a tag for the consumer.
+void ringPublish(PacketRing *ring, int size, long long tag);
+
+// Producer: nothing more will be queued.
+void ringClose(PacketRing *ring);
+
+// Consumer: the oldest queued buffer with its size and tag (tag may be NULL), waiting while
+// the ring is empty. Return NULL once the ring is empty and closed.
+unsigned char *ringPeek(PacketRing *ring, int *size, long long *tag);
+
+// Consumer: as ringPeek(), but waits at most timeoutMs. Return NULL with timedOut set if the
+// ring is still empty by then, NULL with timedOut cleared once it is empty and closed.
+unsigned char *ringPeekTimed(PacketRing *ring, int *size, long long *tag, int timeoutMs, int *timedOut);
+
+// Consumer: give back the buffer from ringPeek().
+void ringRelease(PacketRing *ring);
+
+// Consumer: stop taking buffers, the producer's ringReserve() returns NULL from now on.
+void ringAbort(PacketRing *ring);
+
+// Fill stats (may be NULL) and free the ring. Both threads must be done with it.
+void freeRing(PacketRing *ring, RingStatistics *stats);
+
+#endif // _PACKET_RING_H_
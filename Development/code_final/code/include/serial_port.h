@@ -0,0 +1,15 @@
+// Serial port line speed.
+
+#ifndef _SERIAL_PORT_H_
+#define _SERIAL_PORT_H_
+
+// Program baudRate (bits per second) on an open, already configured serial port.
+// Rates in the standard table use their Bxxx constant, any other rate is set
+// through termios2 and BOTHER if the driver accepts it.
+// Return the output rate read back from the port, or -1 on error.
+int setBaudRate(int fd, int baudRate);
+
+// Bxxx constant of a standard rate, or -1 if the rate is not in the table.
+int baudConstant(int baudRate);
+
+#endif // _SERIAL_PORT_H_
@@ -0,0 +1,45 @@
+// Receiver storage: the output file preallocated and written in large blocks off the link thread.
+
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#define STORAGE_BLOCK_SIZE (64 * 1024)
+#define STORAGE_BUFFERS 8           // Default number of blocks held in memory, the one filling included
+#define STORAGE_MAX_AGE_MS 500      // A block older than this is written even if it is not full
+
+enum SYNC_POLICY {SYNC_NONE = 0, SYNC_BLOCK, SYNC_END};
+
+// Payloads are copied into a buffer until it reaches the next STORAGE_BLOCK_SIZE boundary
+// of the file, a payload lands anywhere but right after the previous one, or the buffer is
+// STORAGE_MAX_AGE_MS old, which the writer also checks while no payloads arrive. The buffer
+// then goes through a packet ring to a writer thread, which puts it at its offset with
+// pwrite() and, with SYNC_BLOCK, waits for fdatasync().
+// storeAt() only waits when every buffer is queued for the disk.
+
+typedef struct Storage Storage;
+
+typedef struct {
+    long long bytes;
+    int writes;                 // pwrite() calls
+    int syncs;                  // fdatasync() calls
+    int preallocated;           // fallocate() reserved the whole file
+    double writerSeconds;       // Time the writer spent in pwrite() and fdatasync()
+    double stallSeconds;        // Time storeAt() waited for a free buffer
+} StorageStatistics;
+
+// Run on the writer thread once size bytes of data are written at offset, and synced with SYNC_BLOCK.
+typedef void (*StoredCallback)(void *context, const unsigned char *data, int size, long long offset);
+
+// Reserve fileSize bytes of fd and start the writer thread with buffers blocks (at least 2).
+// stored may be NULL. Return NULL on error.
+Storage *openStorage(int fd, long long fileSize, int policy, int buffers, StoredCallback stored, void *context);
+
+// Copy size bytes of data, to be written at offset.
+// Return -1 once a write has failed, which shows when a new buffer is needed.
+int storeAt(Storage *storage, const unsigned char *data, int size, long long offset);
+
+// Write what is left, sync it with SYNC_END, fill stats (may be NULL) and free the storage.
+// Return -1 if a write or sync failed.
+int closeStorage(Storage *storage, StorageStatistics *stats);
+
+#endif // _STORAGE_H_
@@ -0,0 +1,17 @@
+// XOR whitening of frame payloads against byte stuffing.
+
+#ifndef _WHITEN_H_
+#define _WHITEN_H_
+
+// Every payload byte is XORed with the same mask byte. Stuffing then costs one byte
+// for each payload byte equal to flag ^ mask or escape ^ mask, so a single byte
+// histogram prices all 256 masks at once and the cheapest one is kept.
+
+// Return the mask giving the fewest bytes equal to flag or escape once size bytes of data
+// and the mask itself (sent in front of them) are XORed. 0 when nothing needs escaping.
+unsigned char chooseMask(const unsigned char *data, int size, unsigned char flag, unsigned char escape);
+
+// Write size bytes of src XORed with mask to dst. dst may overlap src if it starts at or before it.
+void applyMask(unsigned char *dst, const unsigned char *src, int size, unsigned char mask);
+
+#endif // _WHITEN_H_
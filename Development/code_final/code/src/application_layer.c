@@ -1,21 +1,54 @@
 // Application layer protocol implementation
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "link_layer.h"
+#include "link_sendfile.h"
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include "application_layer.h"
+#include "compress.h"
+#include "block_pipeline.h"
+#include "crc.h"
+#include "storage.h"
+#include "packet_ring.h"
 
 int FRAME_SIZE = 200;
 int INPUT_SIZE = 100;
 
-enum CONTROL_TYPE {DATA = 1, START, END};
- 
+enum CONTROL_TYPE {DATA = 1, START, END, SEGMENT, ENTRY, RESUME};
+enum CONTROL_PARAMETER {FILE_SIZE = 0, OPTIONS, FILE_NAME, FILE_MODE, FILE_MTIME, FILE_MTIME_NS,  //Types of the control packet fields
+    RESUME_OFFSET, RESUME_CRC};
+#define OPTION_COMPRESSION 0x01     //Data packets may carry LZ4 blocks
+#define OPTION_BLOCKS 0x02          //Data packets carry the block pipeline's stream
+#define OPTION_BATCH 0x04           //ENTRY packets introduce each file of a directory
+#define OPTION_RESUME 0x08          //The receiver answers START with its checkpoint
+#define COMPRESSED 0x80             //Set in the control byte of a compressed data packet
 
-int createControlPacket(int type, int fileSize, unsigned char *controlPacket) {
+//Transfer statistics for the compression report, per thread when links are bonded
+typedef struct {
+    long long fileBytes;    //Data packet bytes before compression
+    long long wireBytes;    //after it
+    int packets;
+    int rawPackets;         //Sent as they were, compression would not shrink them
+    struct timespec start;
+    PipelineStatistics blocks;
+    RingStatistics reader;  //Transmitter read-ahead, buffers stays 0 when it did not run
+} TransferStats;
+__thread TransferStats transfer;
+
+int createControlPacket(int type, int fileSize, int options, unsigned char *controlPacket) {
     //Returns the size of the controlPacket
     controlPacket[0] = (unsigned char) type;
-    controlPacket[1] = 0; //We are only sending file size, not name
+    controlPacket[1] = FILE_SIZE;
     int i = 2;
     while (fileSize > 0) {
         i++; //At the beginning so i is the number of bytes actually used
@@ -23,37 +56,291 @@ int createControlPacket(int type, int fileSize, unsigned char *controlPacket) {
         fileSize = (int) fileSize / 256;
     }
     controlPacket[2] = i - 2; //Number of bytes needed for file size
+    if (options != 0) {
+        controlPacket[++i] = OPTIONS;
+        controlPacket[++i] = 1;
+        controlPacket[++i] = (unsigned char) options;
+    }
     return i + 1; //Size (last index + 0)
 }
 
-void readControlPacket(int *type, int *fileSize, unsigned char *controlPacket) {
-    *type = (int) controlPacket[0]; //controlPacket[1] is irrelevant since we are only sending the file size
+void readControlPacket(int *type, int *fileSize, int *options, unsigned char *controlPacket, int size) {
+    *type = (int) controlPacket[0];
     *fileSize = 0;
-    for (int i = ((int) controlPacket[2]) + 2; i > 2; i--) {
-        *fileSize = *fileSize * 256 + ((int) controlPacket[i]);
-        //We are rebuilding the size in the opposite direction
+    *options = 0;
+    int i = 1;
+    while (i + 1 < size && i + 2 + controlPacket[i + 1] <= size) {
+        int length = controlPacket[i + 1];
+        if (controlPacket[i] == FILE_SIZE) {
+            for (int j = i + 1 + length; j > i + 1; j--) {
+                *fileSize = *fileSize * 256 + ((int) controlPacket[j]);
+                //We are rebuilding the size in the opposite direction
+            }
+        }
+        else if (controlPacket[i] == OPTIONS && length >= 1) {
+            *options = controlPacket[i + 2];
+        }
+        i += 2 + length;    //Fields we do not know are skipped
+    }
+}
+
+int putNumber(unsigned char *packet, int i, int type, unsigned long long value) {
+    //Appends a field holding value little-endian in as few bytes as needed, like FILE_SIZE
+    //Returns the size of the packet with it
+    int length = 0;
+    packet[i] = type;
+    while (value > 0) {
+        packet[i + 2 + length++] = value & 0xff;
+        value >>= 8;
+    }
+    packet[i + 1] = length;
+    return i + 2 + length;
+}
+
+unsigned long long getNumber(const unsigned char *value, int length) {
+    unsigned long long number = 0;
+    for (int j = length - 1; j >= 0; j--) {
+        number = number << 8 | value[j];
     }
-    //No need to return size since we are saving fileSize already
+    return number;
 }
 
-void createDataPacket(int sequenceNumber, int fileSize, unsigned char *dataPacket, unsigned char *inputData) {
+const unsigned char *findField(const unsigned char *packet, int size, int type, int *length) {
+    //Value of the first field of that type after the packet type, NULL if there is none
+    int i = 1;
+    while (i + 1 < size && i + 2 + packet[i + 1] <= size) {
+        if (packet[i] == type) {
+            *length = packet[i + 1];
+            return packet + i + 2;
+        }
+        i += 2 + packet[i + 1];
+    }
+    return NULL;
+}
+
+int createDataPacket(int sequenceNumber, int fileSize, int compress, unsigned char *dataPacket, unsigned char *inputData) {
+    //Returns the size of the dataPacket
     dataPacket[0] = DATA;
     dataPacket[1] = (unsigned char) (sequenceNumber % 256);
-    dataPacket[2] = (unsigned char) (fileSize / 256);
-    dataPacket[3] = (unsigned char) (fileSize % 256); //All 4 direct from requirements
-    for (size_t i = 0; i < fileSize; i++) {
-        dataPacket[i+4] = inputData[i];
+    int size = compress ? compressBlock(dataPacket + 4, FRAME_SIZE - 4, inputData, fileSize) : -1;
+    transfer.fileBytes += fileSize;
+    transfer.packets++;
+    if (size > 0) {
+        dataPacket[0] |= COMPRESSED;
+    }
+    else {
+        size = fileSize;
+        memcpy(dataPacket + 4, inputData, fileSize);
+        transfer.rawPackets++;
     }
+    transfer.wireBytes += size;
+    dataPacket[2] = (unsigned char) (size / 256);
+    dataPacket[3] = (unsigned char) (size % 256); //All 4 direct from requirements
+    return size + 4;
+}
+
+int dataPacketHeader(void *context, unsigned char *header, long long offset, int size) {
+    //llsendfile() callback: the 4 bytes createDataPacket() puts in front of an uncompressed payload,
+    //the file bytes follow them in the frame. context is the packet counter.
+    int *counter = context;
+    header[0] = DATA;
+    header[1] = (unsigned char) (*counter % 256);
+    header[2] = (unsigned char) (size / 256);
+    header[3] = (unsigned char) (size % 256);
+    (*counter)++;
+    transfer.fileBytes += size;
+    transfer.wireBytes += size;
+    transfer.packets++;
+    transfer.rawPackets++;
+    return 4;
 }
 
-void readDataPacket(int *sequenceNumber, int *fileSize, unsigned char *dataPacket, unsigned char *outputData) {
+int readDataPacket(int *sequenceNumber, int *fileSize, unsigned char *dataPacket, unsigned char *outputData) {
+    //Returns -1 if a compressed payload is damaged
     *sequenceNumber = (int) dataPacket[1];
-    *fileSize = ((int) dataPacket[2]) * 256 + ((int) dataPacket[3]);
-    for (size_t i = 0; i < *fileSize; i++) {
-        outputData[i] = dataPacket[i+4];
+    int size = ((int) dataPacket[2]) * 256 + ((int) dataPacket[3]);
+    transfer.wireBytes += size;
+    transfer.packets++;
+    if (dataPacket[0] & COMPRESSED) {
+        *fileSize = decompressBlock(outputData, FRAME_SIZE, dataPacket + 4, size);
+        if (*fileSize < 0) {
+            return -1;
+        }
+    }
+    else {
+        *fileSize = size;
+        memcpy(outputData, dataPacket + 4, size);
+        transfer.rawPackets++;
+    }
+    transfer.fileBytes += *fileSize;
+    return 0;
+}
+
+void printTransferStatistics(int options, const PipelineStatistics *blocks) {
+    //blocks is NULL unless the block pipeline ran, whose stream the data packets then carried
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - transfer.start.tv_sec) + (end.tv_nsec - transfer.start.tv_nsec) / 1e9;
+    long long fileBytes = blocks != NULL ? blocks->originalBytes : transfer.fileBytes;
+    double ratio = transfer.wireBytes > 0 ? (double) fileBytes / transfer.wireBytes : 1.0;
+    printf("Transfer statistics\n"
+           "  - Compression: %s\n"
+           "  - Data packets: %d (%d uncompressed)\n"
+           "  - Data bytes: %lld, %lld on the link (ratio %.2f)\n"
+           "  - Throughput: %.0f bytes/s of file data over %.0f bytes/s on the link\n",
+           options & OPTION_BLOCKS ? "LZH blocks" : options & OPTION_COMPRESSION ? "LZ4" : "off",
+           transfer.packets,
+           blocks != NULL ? 0 : transfer.rawPackets,
+           fileBytes,
+           transfer.wireBytes,
+           ratio,
+           seconds > 0 ? fileBytes / seconds : 0.0,
+           seconds > 0 ? transfer.wireBytes / seconds : 0.0);
+    if (blocks != NULL) {
+        printf("  - Blocks: %d (%d stored uncompressed)\n"
+               "  - Worker CPU time: %.3f s, link waited %.3f s on the workers\n",
+               blocks->blocks,
+               blocks->rawBlocks,
+               blocks->workerSeconds,
+               blocks->stallSeconds);
+    }
+    if (transfer.reader.buffers > 0) {
+        printf("  - Read-ahead: up to %d packets queued, link waited %.3f s on the reader (%d times),"
+               " reader waited %.3f s on the link\n",
+               transfer.reader.peak,
+               transfer.reader.emptySeconds,
+               transfer.reader.emptyWaits,
+               transfer.reader.fullSeconds);
     }
 }
 
+int pipelineWorkers() {
+    //APP_WORKERS threads, one per CPU by default
+    const char *value = getenv("APP_WORKERS");
+    int workers = value != NULL && value[0] != '\0' ? atoi(value) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return workers > 0 ? workers : 1;
+}
+
+int syncPolicy() {
+    //APP_SYNC: "block" syncs each block as it is written, "end" the whole file once it is complete
+    const char *value = getenv("APP_SYNC");
+    if (value != NULL && strcmp(value, "block") == 0) {
+        return SYNC_BLOCK;
+    }
+    if (value != NULL && strcmp(value, "end") == 0) {
+        return SYNC_END;
+    }
+    return SYNC_NONE;
+}
+
+#define PIPELINE_MEMORY_KB (STORAGE_BUFFERS * STORAGE_BLOCK_SIZE / 1024)     //Default of APP_PIPELINE_KB
+
+int pipelineMemory() {
+    //APP_PIPELINE_KB: bytes each end may hold in buffers between the disk and the link
+    const char *value = getenv("APP_PIPELINE_KB");
+    int kb = value != NULL && value[0] != '\0' ? atoi(value) : 0;
+    return (kb > 0 ? kb : PIPELINE_MEMORY_KB) * 1024;
+}
+
+void printStorageStatistics(const StorageStatistics *storage) {
+    printf("  - Storage: %lld bytes in %d writes (%.0f bytes each), %d syncs, %s\n"
+           "  - Writer busy %.3f s, link waited %.3f s on the disk\n",
+           storage->bytes,
+           storage->writes,
+           storage->writes > 0 ? (double) storage->bytes / storage->writes : 0.0,
+           storage->syncs,
+           storage->preallocated ? "preallocated" : "not preallocated",
+           storage->writerSeconds,
+           storage->stallSeconds);
+}
+
+int sendBlocks(FILE *filePtr, int fileSize, int *counter) {
+    //Sends the compressed stream while the workers prepare the next blocks
+    BlockPipeline *pipeline = startCompression(fileno(filePtr), fileSize, pipelineWorkers());
+    if (pipeline == NULL) {
+        printf("Error starting the compression workers\n");
+        return -1;
+    }
+    unsigned char frame[FRAME_SIZE];
+    const unsigned char *block;
+    int blockSize;
+    while ((block = nextBlock(pipeline, &blockSize)) != NULL) {
+        for (int i = 0; i < blockSize; i += INPUT_SIZE) {
+            int chunk = blockSize - i < INPUT_SIZE ? blockSize - i : INPUT_SIZE;
+            int size = createDataPacket(*counter, chunk, FALSE, frame, (unsigned char *) block + i);
+            if (llwrite(frame, size) == -1) {
+                printf("Error sending data packet\n");
+            }
+            (*counter)++;
+        }
+        releaseBlock(pipeline);
+    }
+    PipelineStatistics stats;
+    int result = finishPipeline(pipeline, &stats);
+    if (result != 0) {
+        printf("Error compressing the file\n");
+    }
+    transfer.blocks = stats;
+    return result;
+}
+
+typedef struct {
+    FILE *filePtr;
+    int counter;
+    int compress;
+    PacketRing *ring;
+    TransferStats transfer;     //The reader thread's counts, merged once it is joined
+} Reader;
+
+void *readPackets(void *argument) {
+    //Reader thread: builds data packets ahead of the link until the file ends or the link gives up
+    Reader *reader = argument;
+    unsigned char input[INPUT_SIZE];
+    unsigned char *packet;
+    memset(&transfer, 0, sizeof(transfer));
+    while ((packet = ringReserve(reader->ring)) != NULL) {
+        int size = fread(input, 1, INPUT_SIZE, reader->filePtr);
+        if (size <= 0) {
+            break;
+        }
+        ringPublish(reader->ring, createDataPacket(reader->counter, size, reader->compress, packet, input), 0);
+        reader->counter++;
+    }
+    ringClose(reader->ring);
+    reader->transfer = transfer;
+    return NULL;
+}
+
+int sendPipelined(FILE *filePtr, int *counter, int options) {
+    //Sends the packets a reader thread prepares from filePtr's position on, so the link does not
+    //wait on the disk while the ring holds packets. Returns -1 if the reader could not start.
+    PacketRing *ring = createRing(pipelineMemory() / FRAME_SIZE, FRAME_SIZE, sizeof(void *));
+    Reader reader = {filePtr, *counter, options & OPTION_COMPRESSION, ring};
+    pthread_t thread;
+    if (ring == NULL || pthread_create(&thread, NULL, readPackets, &reader) != 0) {
+        if (ring != NULL) {
+            freeRing(ring, NULL);
+        }
+        return -1;
+    }
+    unsigned char *packet;
+    int size;
+    while ((packet = ringPeek(ring, &size, NULL)) != NULL) {
+        if (llwrite(packet, size) == -1) {
+            printf("Error sending data packet\n");
+        }
+        ringRelease(ring);
+    }
+    pthread_join(thread, NULL);
+    freeRing(ring, &transfer.reader);
+    *counter = reader.counter;
+    transfer.fileBytes += reader.transfer.fileBytes;
+    transfer.wireBytes += reader.transfer.wireBytes;
+    transfer.packets += reader.transfer.packets;
+    transfer.rawPackets += reader.transfer.rawPackets;
+    return 0;
+}
+
 int findSize(const char file_name[]) {
     FILE *fp;
     fp = fopen(file_name, "rb");
@@ -68,7 +355,7 @@ int findSize(const char file_name[]) {
 }
 
 
-int setupTransmitter(LinkLayer connectionParameters, char filename[]) {
+int setupTransmitter(LinkLayer connectionParameters, const char *filename, int options) {
     if (llopen(connectionParameters) != 1) {
         printf("Error in llopen\n");
         return -1;
@@ -77,7 +364,12 @@ int setupTransmitter(LinkLayer connectionParameters, char filename[]) {
 
     //Send control packet
     unsigned char frame[FRAME_SIZE];
-    int size = createControlPacket(START,findSize(filename),frame);
+    int size = createControlPacket(START,findSize(filename),options,frame);
+    struct stat info;
+    if ((options & OPTION_RESUME) && stat(filename, &info) == 0) {  //Tells a checkpoint of this file from one of another
+        size = putNumber(frame, size, FILE_MTIME, info.st_mtim.tv_sec);
+        size = putNumber(frame, size, FILE_MTIME_NS, info.st_mtim.tv_nsec);
+    }
     if (llwrite(frame, size) == -1) {
         printf("Error sending control packet\n");
     }
@@ -86,7 +378,8 @@ int setupTransmitter(LinkLayer connectionParameters, char filename[]) {
     return 0;
 }
 
-int setupReceiver(LinkLayer connectionParameters, int *fileSize) {
+int setupReceiver(LinkLayer connectionParameters, int *fileSize, int *options, unsigned char *frame, int *size) {
+    //frame receives the START packet, FRAME_SIZE bytes, and size its size
     if (llopen(connectionParameters) != 1) {
         printf("Error in llopen\n");
         return -1;
@@ -94,12 +387,12 @@ int setupReceiver(LinkLayer connectionParameters, int *fileSize) {
     printf("Success in llopen\n");
 
     //Receive control packet
-    unsigned char frame[FRAME_SIZE];
-    if (llread((frame)) == -1){
+    *size = llread(frame);
+    if (*size == -1){
         printf("Error receiving control packet\n");
     }
     int type;
-    readControlPacket(&type, fileSize, frame);
+    readControlPacket(&type, fileSize, options, frame, *size);
     if (type != START) {
         printf("Error receiving control packet\n");
         return -1;
@@ -109,6 +402,944 @@ int setupReceiver(LinkLayer connectionParameters, int *fileSize) {
     return 0;
 }
 
+//Bonded mode: APP_BOND names more serial ports, and each port runs its own link on its own thread.
+//Data goes in SEGMENT packets that carry their file offset, so the links share the file
+//as they go and the receiver writes every packet where it belongs.
+//A SEGMENT packet is a data packet with the offset in front: type, offset (4 bytes), size (2 bytes), data.
+#define BOND_MAX_LINKS 8
+#define BOND_HISTORY 8      //Packets a link may still owe acknowledgements for: a full window and the one being written
+enum LINK_STATE {LINK_OPENING = 0, LINK_UP, LINK_CLOSING, LINK_DONE, LINK_DOWN};
+
+typedef struct Bond Bond;
+
+typedef struct {
+    Bond *bond;
+    LinkLayer parameters;
+    pthread_t thread;
+    int state;
+    int idle;                           //Transmitter: out of work, waiting for the others
+    long long history[BOND_HISTORY];    //Transmitter: offsets of the last packets written
+    int historyCount;
+    long long progressUs;               //Last time the link moved a packet
+    long long bytes;                    //File bytes carried
+    int started;                        //The thread was created
+    int running;                        //and has not returned yet
+    TransferStats transfer;
+} BondLink;
+
+struct Bond {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int links;
+    BondLink link[BOND_MAX_LINKS];
+    int fd;
+    long long fileSize;         //Receiver: -1 until a START packet arrived
+    int options;
+    long long stallUs;          //A link that moved nothing for this long is down
+    long long nextOffset;       //Transmitter: first byte no link took yet
+    long long requeued[BOND_MAX_LINKS * BOND_HISTORY];  //Transmitter: packets of links that went down
+    int requeuedCount;
+    int alive;
+    int idle;
+    unsigned char *covered;     //Receiver: one flag per packet of the file
+    long long coveredCount;
+    long long packetCount;
+};
+
+long long monotonicUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int createSegmentPacket(long long offset, int fileSize, int compress, unsigned char *segmentPacket, unsigned char *inputData) {
+    //Returns the size of the segmentPacket. Built as a data packet 3 bytes further, whose
+    //type and sequence number then make room for the offset.
+    int size = createDataPacket(0, fileSize, compress, segmentPacket + 3, inputData);
+    segmentPacket[0] = SEGMENT | (segmentPacket[3] & COMPRESSED);
+    for (int i = 0; i < 4; i++) {
+        segmentPacket[1 + i] = (unsigned char) (offset >> (24 - 8 * i));
+    }
+    return size + 3;
+}
+
+int readSegmentPacket(long long *offset, int *fileSize, unsigned char *segmentPacket, unsigned char *outputData) {
+    //Returns -1 if a compressed payload is damaged. Overwrites the offset.
+    *offset = 0;
+    for (int i = 0; i < 4; i++) {
+        *offset = (*offset << 8) | segmentPacket[1 + i];
+    }
+    segmentPacket[3] = DATA | (segmentPacket[0] & COMPRESSED);
+    int sequenceNumber;
+    return readDataPacket(&sequenceNumber, fileSize, segmentPacket + 3, outputData);
+}
+
+int writeAt(int fd, const unsigned char *data, int size, long long offset) {
+    for (int done = 0; done < size;) {
+        ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int bondPorts(const char *serialPort, char ports[][50]) {
+    //The port given to the application first, then APP_BOND's comma-separated list
+    //Returns the number of ports, 1 when bonding is off
+    const char *value = getenv("APP_BOND");
+    strncpy(ports[0], serialPort, 49);
+    ports[0][49] = '\0';
+    int count = 1;
+    while (value != NULL && *value != '\0' && count < BOND_MAX_LINKS) {
+        int length = strcspn(value, ",");
+        if (length > 0 && length < 50) {
+            memcpy(ports[count], value, length);
+            ports[count][length] = '\0';
+            count++;
+        }
+        value += length;
+        if (*value == ',') {
+            value++;
+        }
+    }
+    return count;
+}
+
+void linkDown(Bond *bond, BondLink *link) {
+    //Lock held. The packets the link may not have delivered go to the others.
+    if (link->state == LINK_DOWN || link->state == LINK_DONE) {
+        return;
+    }
+    int lost = link->historyCount < BOND_HISTORY ? link->historyCount : BOND_HISTORY;
+    for (int i = 0; i < lost; i++) {
+        bond->requeued[bond->requeuedCount++] = link->history[i];
+    }
+    link->historyCount = 0;
+    if (link->idle) {
+        bond->idle--;
+    }
+    link->state = LINK_DOWN;
+    bond->alive--;
+    printf("Link on %s is down", link->parameters.serialPort);
+    if (lost > 0) {
+        printf(", %d packets handed to the other links", lost);
+    }
+    printf("\n");
+    pthread_cond_broadcast(&bond->changed);
+}
+
+int takeSegment(Bond *bond, BondLink *link, int carried, long long *offset) {
+    //carried: file bytes of the packet the link just wrote.
+    //Returns 1 with the offset of the next packet to send, 0 once every link ran out of work,
+    //or -1 if the link was declared down meanwhile
+    pthread_mutex_lock(&bond->lock);
+    link->progressUs = monotonicUs();
+    link->bytes += carried;
+    int result = 1;
+    while (1) {
+        if (link->state == LINK_DOWN) {
+            result = -1;
+            break;
+        }
+        if (bond->requeuedCount > 0) {
+            *offset = bond->requeued[--bond->requeuedCount];
+            break;
+        }
+        if (bond->nextOffset < bond->fileSize) {
+            *offset = bond->nextOffset;
+            bond->nextOffset += INPUT_SIZE;
+            break;
+        }
+        if (!link->idle) {
+            link->idle = TRUE;
+            bond->idle++;
+            pthread_cond_broadcast(&bond->changed);
+        }
+        if (bond->idle == bond->alive) {
+            result = 0;     //Nobody can hand back packets any more
+            break;
+        }
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    }
+    if (result == 1) {
+        if (link->idle) {
+            link->idle = FALSE;
+            bond->idle--;
+        }
+        link->history[link->historyCount++ % BOND_HISTORY] = *offset;
+    }
+    pthread_mutex_unlock(&bond->lock);
+    return result;
+}
+
+void setLinkState(Bond *bond, BondLink *link, int state) {
+    pthread_mutex_lock(&bond->lock);
+    if (link->state != LINK_DOWN) {
+        link->state = state;
+        link->progressUs = monotonicUs();
+        if (state == LINK_DONE) {
+            link->historyCount = 0;     //Everything was acknowledged
+        }
+    }
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+}
+
+void *sendLink(void *argument) {
+    BondLink *link = argument;
+    Bond *bond = link->bond;
+    memset(&transfer, 0, sizeof(transfer));
+    unsigned char packet[FRAME_SIZE + 3];    //Room for a data packet 3 bytes in
+    unsigned char input[INPUT_SIZE];
+    if (access(link->parameters.serialPort, R_OK | W_OK) != 0 || llopen(link->parameters) != 1) {
+        pthread_mutex_lock(&bond->lock);
+        linkDown(bond, link);
+        pthread_mutex_unlock(&bond->lock);
+        return NULL;
+    }
+    setLinkState(bond, link, LINK_UP);
+    int size = createControlPacket(START, bond->fileSize, bond->options, packet);
+    int failed = llwrite(packet, size) == -1;
+    long long offset;
+    int taken;
+    int carried = 0;
+    while (!failed && (taken = takeSegment(bond, link, carried, &offset)) == 1) {
+        int chunk = bond->fileSize - offset < INPUT_SIZE ? bond->fileSize - offset : INPUT_SIZE;
+        if (pread(bond->fd, input, chunk, offset) != chunk) {
+            printf("Error reading the file\n");
+            failed = TRUE;
+            break;
+        }
+        size = createSegmentPacket(offset, chunk, bond->options & OPTION_COMPRESSION, packet, input);
+        failed = llwrite(packet, size) == -1;
+        carried = chunk;
+    }
+    if (!failed && taken == 0) {
+        setLinkState(bond, link, LINK_CLOSING);
+        size = createControlPacket(END, bond->fileSize, 0, packet);
+        failed = llwrite(packet, size) == -1 || llclose(TRUE) == -1;
+    }
+    pthread_mutex_lock(&bond->lock);
+    if (failed) {
+        linkDown(bond, link);
+    }
+    pthread_mutex_unlock(&bond->lock);
+    if (!failed) {
+        setLinkState(bond, link, LINK_DONE);
+    }
+    link->transfer = transfer;
+    return NULL;
+}
+
+void *receiveLink(void *argument) {
+    BondLink *link = argument;
+    Bond *bond = link->bond;
+    memset(&transfer, 0, sizeof(transfer));
+    unsigned char packet[FRAME_SIZE + 3];
+    unsigned char output[FRAME_SIZE];
+    if (access(link->parameters.serialPort, R_OK | W_OK) != 0 || llopen(link->parameters) != 1) {
+        pthread_mutex_lock(&bond->lock);
+        linkDown(bond, link);
+        pthread_mutex_unlock(&bond->lock);
+        return NULL;
+    }
+    setLinkState(bond, link, LINK_UP);
+    int failed = FALSE;
+    while (1) {
+        int size = llread(packet);
+        if (size <= 0) {
+            failed = TRUE;
+            break;
+        }
+        int type = packet[0] & ~COMPRESSED;
+        if (type == START) {
+            int fileSize, options;
+            readControlPacket(&type, &fileSize, &options, packet, size);
+            pthread_mutex_lock(&bond->lock);
+            if (bond->fileSize < 0) {
+                bond->fileSize = fileSize;
+                bond->options = options;
+                bond->packetCount = (fileSize + INPUT_SIZE - 1) / INPUT_SIZE;
+                bond->covered = calloc(bond->packetCount + 1, 1);
+            }
+            pthread_mutex_unlock(&bond->lock);
+        }
+        else if (type == SEGMENT) {
+            long long offset;
+            int dataSize;
+            if (readSegmentPacket(&offset, &dataSize, packet, output) == -1 || bond->covered == NULL
+                || offset % INPUT_SIZE != 0 || offset + dataSize > bond->fileSize) {
+                printf("Error in segment packet\n");
+                continue;
+            }
+            if (writeAt(bond->fd, output, dataSize, offset) != 0) {
+                printf("Error writing the file\n");
+            }
+            pthread_mutex_lock(&bond->lock);
+            if (!bond->covered[offset / INPUT_SIZE]) {
+                bond->covered[offset / INPUT_SIZE] = TRUE;
+                bond->coveredCount++;
+            }
+            link->bytes += dataSize;
+            link->progressUs = monotonicUs();
+            pthread_cond_broadcast(&bond->changed);
+            pthread_mutex_unlock(&bond->lock);
+        }
+        else if (type == END) {
+            setLinkState(bond, link, LINK_CLOSING);
+            llread(packet);     //Receive DISC
+            failed = llclose(TRUE) == -1;
+            break;
+        }
+    }
+    pthread_mutex_lock(&bond->lock);
+    if (failed) {
+        linkDown(bond, link);
+    }
+    pthread_mutex_unlock(&bond->lock);
+    if (!failed) {
+        setLinkState(bond, link, LINK_DONE);
+    }
+    link->transfer = transfer;
+    return NULL;
+}
+
+void *runLink(void *argument) {
+    //Thread of each bonded link, tells runBond() once it returned
+    BondLink *link = argument;
+    if (link->parameters.role == LlRx) {
+        receiveLink(link);
+    }
+    else {
+        sendLink(link);
+    }
+    pthread_mutex_lock(&link->bond->lock);
+    link->running = FALSE;
+    pthread_cond_broadcast(&link->bond->changed);
+    pthread_mutex_unlock(&link->bond->lock);
+    return NULL;
+}
+
+int linksRunning(Bond *bond) {
+    //Lock held
+    int running = 0;
+    for (int i = 0; i < bond->links; i++) {
+        running += bond->link[i].running;
+    }
+    return running;
+}
+
+void watchBond(Bond *bond, int receiving) {
+    //Waits until every link finished or went down. A link that moved nothing for stallUs is down:
+    //the link layer keeps retrying for ever, the other links take over its packets.
+    //The receiver waits twice as long, its peer needs that time to notice first, unless the file
+    //is complete and a link already closed: the transmitter only closes once it is out of work.
+    pthread_mutex_lock(&bond->lock);
+    while (1) {
+        int finished = 0;
+        int closed = 0;
+        long long now = monotonicUs();
+        for (int i = 0; i < bond->links; i++) {
+            closed |= bond->link[i].state == LINK_DONE;
+        }
+        int complete = receiving && bond->fileSize >= 0 && bond->coveredCount == bond->packetCount;
+        long long limit = receiving && !(complete && closed) ? 2 * bond->stallUs : bond->stallUs;
+        for (int i = 0; i < bond->links; i++) {
+            BondLink *link = &bond->link[i];
+            if (link->state == LINK_DONE || link->state == LINK_DOWN) {
+                finished++;
+            }
+            else if ((!link->idle || link->state == LINK_CLOSING) && now - link->progressUs > limit) {
+                linkDown(bond, link);
+                finished++;
+            }
+        }
+        if (finished == bond->links) {
+            break;
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += 1;
+        pthread_cond_timedwait(&bond->changed, &bond->lock, &until);
+    }
+    pthread_mutex_unlock(&bond->lock);
+}
+
+int runBond(LinkLayer connectionParameters, char ports[][50], int links, int fd, long long fileSize, int *options) {
+    //Sends fileSize bytes of fd, or receives into fd and sets options from the START packet.
+    //Returns -1 if part of the file may be missing
+    Bond *bond = calloc(1, sizeof(Bond));
+    if (bond == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&bond->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&bond->changed, &attributes);
+    pthread_condattr_destroy(&attributes);
+    int receiving = connectionParameters.role == LlRx;
+    bond->links = links;
+    bond->alive = links;
+    bond->fd = fd;
+    bond->fileSize = fileSize;
+    bond->options = *options;
+    bond->stallUs = (long long) connectionParameters.timeout * connectionParameters.nRetransmissions * 1000000;
+    for (int i = 0; i < links; i++) {
+        BondLink *link = &bond->link[i];
+        link->bond = bond;
+        link->parameters = connectionParameters;
+        strcpy(link->parameters.serialPort, ports[i]);
+        link->progressUs = monotonicUs();
+        link->running = TRUE;
+        link->started = pthread_create(&link->thread, NULL, runLink, link) == 0;
+        if (!link->started) {
+            link->running = FALSE;
+            linkDown(bond, link);
+        }
+    }
+    watchBond(bond, receiving);
+
+    //A link declared down while waiting for work returns at once, one still in the link layer
+    //may be retrying a line that is gone for good. Those get a second, then they are detached.
+    pthread_mutex_lock(&bond->lock);
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += 1;
+    int waited = 0;
+    while (linksRunning(bond) > 0 && waited == 0) {
+        waited = pthread_cond_timedwait(&bond->changed, &bond->lock, &until);
+    }
+    pthread_mutex_unlock(&bond->lock);
+    int result = 0;
+    printf("Bonded links\n");
+    for (int i = 0; i < links; i++) {
+        BondLink *link = &bond->link[i];
+        pthread_mutex_lock(&bond->lock);
+        int state = link->state;
+        int running = link->running;
+        long long bytes = link->bytes;
+        pthread_mutex_unlock(&bond->lock);
+        if (running) {
+            pthread_detach(link->thread);
+        }
+        else if (link->started) {
+            pthread_join(link->thread, NULL);
+        }
+        if (state == LINK_DONE) {
+            transfer.fileBytes += link->transfer.fileBytes;
+            transfer.wireBytes += link->transfer.wireBytes;
+            transfer.packets += link->transfer.packets;
+            transfer.rawPackets += link->transfer.rawPackets;
+        }
+        printf("  - %s: %s, %lld file bytes%s\n", link->parameters.serialPort, state == LINK_DONE ? "done" : "down", bytes,
+               running ? ", still retrying" : "");
+    }
+    pthread_mutex_lock(&bond->lock);
+    if (!receiving && (bond->requeuedCount > 0 || bond->nextOffset < bond->fileSize)) {
+        printf("Error: every link went down, %d packets and %lld bytes were not sent\n",
+               bond->requeuedCount, bond->fileSize > bond->nextOffset ? bond->fileSize - bond->nextOffset : 0);
+        result = -1;
+    }
+    if (receiving && (bond->fileSize < 0 || bond->coveredCount < bond->packetCount)) {
+        printf("Error: %lld of %lld packets received\n", bond->coveredCount, bond->packetCount);
+        result = -1;
+    }
+    if (receiving) {
+        printf("File Size: %lld\n", bond->fileSize);
+        *options = bond->options;
+    }
+    pthread_mutex_unlock(&bond->lock);
+    //The bond is not freed: a thread left behind may still come back to it
+    return result;
+}
+
+//Batch mode: a directory given to the transmitter goes over in one session. Every directory and
+//regular file under it is announced by an ENTRY packet with its path, size, mode and time,
+//and a file's data packets follow its ENTRY. The receiver rebuilds the tree under its own filename.
+#define MAX_NAME_SIZE 255   //Longest relative path, a field length is one byte
+
+typedef struct {
+    char name[MAX_NAME_SIZE + 1];
+    long long size;
+    unsigned int mode;          //st_mode, file type included
+    long long mtime;
+    long mtimeNs;
+} Entry;
+
+int createEntryPacket(const Entry *entry, unsigned char *entryPacket) {
+    //Returns the size of the entryPacket, at most MAX_NAME_SIZE + 40 bytes
+    int length = strlen(entry->name);
+    entryPacket[0] = ENTRY;
+    entryPacket[1] = FILE_NAME;
+    entryPacket[2] = length;
+    memcpy(entryPacket + 3, entry->name, length);
+    int i = 3 + length;
+    i = putNumber(entryPacket, i, FILE_SIZE, entry->size);
+    i = putNumber(entryPacket, i, FILE_MODE, entry->mode);
+    i = putNumber(entryPacket, i, FILE_MTIME, entry->mtime);
+    return putNumber(entryPacket, i, FILE_MTIME_NS, entry->mtimeNs);
+}
+
+int readEntryPacket(Entry *entry, const unsigned char *entryPacket, int size) {
+    //Returns -1 unless the packet names a safe relative path: no absolute path, no "..", no empty part
+    memset(entry, 0, sizeof(*entry));
+    int i = 1;
+    while (i + 1 < size && i + 2 + entryPacket[i + 1] <= size) {
+        int length = entryPacket[i + 1];
+        const unsigned char *value = entryPacket + i + 2;
+        if (entryPacket[i] == FILE_NAME) {
+            memcpy(entry->name, value, length);
+            entry->name[length] = '\0';
+        }
+        else if (entryPacket[i] == FILE_SIZE) {
+            entry->size = getNumber(value, length);
+        }
+        else if (entryPacket[i] == FILE_MODE) {
+            entry->mode = getNumber(value, length);
+        }
+        else if (entryPacket[i] == FILE_MTIME) {
+            entry->mtime = getNumber(value, length);
+        }
+        else if (entryPacket[i] == FILE_MTIME_NS) {
+            entry->mtimeNs = getNumber(value, length);
+        }
+        i += 2 + length;
+    }
+    const char *part = entry->name;
+    if (*part == '/' || *part == '\0' || strlen(entry->name) != strcspn(entry->name, "\\")) {
+        return -1;
+    }
+    while (*part != '\0') {
+        int length = strcspn(part, "/");
+        if (length == 0 || (length == 2 && strncmp(part, "..", 2) == 0) || (length == 1 && part[0] == '.')) {
+            return -1;
+        }
+        part += length;
+        if (*part == '/') {
+            part++;
+        }
+    }
+    return 0;
+}
+
+int sendFileData(FILE *filePtr, long long size, int *counter, int options) {
+    //The data packets of one file, exactly size bytes
+    unsigned char frame[FRAME_SIZE];
+    unsigned char input[INPUT_SIZE];
+    if (!(options & OPTION_COMPRESSION)) {
+        return llsendfile(fileno(filePtr), 0, size, INPUT_SIZE, dataPacketHeader, counter) == size ? 0 : -1;
+    }
+    for (long long sent = 0; sent < size;) {
+        int chunk = size - sent < INPUT_SIZE ? size - sent : INPUT_SIZE;
+        if (fread(input, 1, chunk, filePtr) != chunk) {
+            return -1;
+        }
+        int packetSize = createDataPacket(*counter, chunk, options & OPTION_COMPRESSION, frame, input);
+        if (llwrite(frame, packetSize) == -1) {
+            return -1;
+        }
+        (*counter)++;
+        sent += chunk;
+    }
+    return 0;
+}
+
+int sendTree(const char *root, const char *relative, int *counter, int options, long long *files, long long *bytes) {
+    //Sends the entries under root/relative, depth first. Returns -1 once the link failed.
+    char folder[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(folder, sizeof(folder), "%s/%s", root, relative);
+    DIR *directory = opendir(folder);
+    if (directory == NULL) {
+        printf("Error opening %s\n", folder);
+        return 0;
+    }
+    struct dirent *item;
+    int result = 0;
+    while (result == 0 && (item = readdir(directory)) != NULL) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+            continue;
+        }
+        Entry entry;
+        int length = snprintf(entry.name, sizeof(entry.name), "%s%s%s", relative, relative[0] != '\0' ? "/" : "", item->d_name);
+        if (length > MAX_NAME_SIZE) {
+            printf("Skipping %s/%s, the path is too long\n", folder, item->d_name);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", root, entry.name);
+        struct stat info;
+        if (lstat(path, &info) != 0 || !(S_ISREG(info.st_mode) || S_ISDIR(info.st_mode))) {
+            continue;   //Links, devices and the like stay behind
+        }
+        FILE *filePtr = NULL;
+        if (S_ISREG(info.st_mode) && (filePtr = fopen(path, "rb")) == NULL) {
+            printf("Error opening %s\n", path);
+            continue;
+        }
+        entry.size = S_ISREG(info.st_mode) ? info.st_size : 0;
+        entry.mode = info.st_mode;
+        entry.mtime = info.st_mtim.tv_sec;
+        entry.mtimeNs = info.st_mtim.tv_nsec;
+        unsigned char packet[MAX_NAME_SIZE + 40];
+        if (llwrite(packet, createEntryPacket(&entry, packet)) == -1) {
+            result = -1;
+        }
+        else if (filePtr != NULL) {
+            if (sendFileData(filePtr, entry.size, counter, options) != 0) {
+                printf("Error sending %s\n", path);
+                result = -1;    //The receiver would take the next entry's packets as this file's
+            }
+            (*files)++;
+            *bytes += entry.size;
+        }
+        else {
+            result = sendTree(root, entry.name, counter, options, files, bytes);
+        }
+        if (filePtr != NULL) {
+            fclose(filePtr);
+        }
+    }
+    closedir(directory);
+    return result;
+}
+
+void sendBatch(LinkLayer connectionParameters, const char *root, int options) {
+    if (llopen(connectionParameters) != 1) {
+        printf("Error in llopen\n");
+        return;
+    }
+    printf("Success in llopen\n");
+    unsigned char frame[FRAME_SIZE];
+    int size = createControlPacket(START, 0, options, frame);
+    if (llwrite(frame, size) == -1) {
+        printf("Error sending control packet\n");
+    }
+    int counter = 0;
+    long long files = 0;
+    long long bytes = 0;
+    if (sendTree(root, "", &counter, options, &files, &bytes) != 0) {
+        printf("Error sending the directory\n");
+    }
+    size = createControlPacket(END, 0, 0, frame);
+    if (llwrite(frame, size) == -1) {
+        printf("Error sending final control packet\n");
+    }
+    if (llclose(TRUE) == -1) {
+        printf("Error in llclose\n");
+    }
+    printf("Batch sent: %lld files, %lld bytes\n", files, bytes);
+    printTransferStatistics(options, NULL);
+}
+
+int makeParents(char *path) {
+    //Creates the directories leading to path, path itself excluded
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int result = mkdir(path, 0755);
+        *slash = '/';
+        if (result != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void finishEntry(FILE *filePtr, const Entry *entry, long long written) {
+    //Closes a received file with the transmitter's mode and time
+    if (written != entry->size) {
+        printf("Error: %s ended after %lld of %lld bytes\n", entry->name, written, entry->size);
+    }
+    fflush(filePtr);
+    struct timespec times[2] = {{0, UTIME_OMIT}, {entry->mtime, entry->mtimeNs}};
+    fchmod(fileno(filePtr), entry->mode & 07777);
+    futimens(fileno(filePtr), times);
+    fclose(filePtr);
+}
+
+void finishDirectories(const char *root, Entry *directories, int count) {
+    //Directory modes and times wait until the end: a read-only directory must still take its files,
+    //and each file created in it moves its time. The deepest come last in the list, so they go first.
+    char path[PATH_MAX];
+    for (int i = count - 1; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, directories[i].name);
+        struct timespec times[2] = {{0, UTIME_OMIT}, {directories[i].mtime, directories[i].mtimeNs}};
+        chmod(path, directories[i].mode & 07777);
+        utimensat(AT_FDCWD, path, times, 0);
+    }
+}
+
+void receiveBatch(const char *root, int options) {
+    //Runs until the END packet, after the START packet was read
+    unsigned char frame[MAX_PAYLOAD_SIZE];
+    unsigned char output[FRAME_SIZE];
+    char path[PATH_MAX];
+    if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+        printf("Error creating %s\n", root);
+    }
+    Entry entry;
+    FILE *filePtr = NULL;
+    long long written = 0;
+    long long files = 0;
+    long long bytes = 0;
+    Entry *directories = NULL;
+    int directoryCount = 0;
+    while (1) {
+        int size = llread(frame);
+        if (size <= 0) {
+            printf("Error receiving data packet\n");
+            if (size == 0) {
+                break;      //The transmitter left without END
+            }
+            continue;
+        }
+        if (frame[0] == END) {
+            llread(frame);  //Receive DISC
+            break;
+        }
+        if (frame[0] == ENTRY) {
+            if (filePtr != NULL) {
+                finishEntry(filePtr, &entry, written);
+                filePtr = NULL;
+            }
+            if (readEntryPacket(&entry, frame, size) != 0) {
+                printf("Error: unsafe entry name, skipped\n");
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", root, entry.name);
+            if (makeParents(path) != 0) {
+                printf("Error creating the directories of %s\n", path);
+            }
+            if (S_ISDIR(entry.mode)) {
+                if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                    printf("Error creating %s\n", path);
+                }
+                Entry *grown = realloc(directories, (directoryCount + 1) * sizeof(Entry));
+                if (grown != NULL) {
+                    directories = grown;
+                    directories[directoryCount++] = entry;
+                }
+            }
+            else if ((filePtr = fopen(path, "wb")) == NULL) {
+                printf("Error creating %s\n", path);
+            }
+            else {
+                written = 0;
+                files++;
+            }
+            continue;
+        }
+        int sequenceNumber;
+        int dataSize;
+        if (readDataPacket(&sequenceNumber, &dataSize, frame, output) == -1) {
+            printf("Error decompressing data packet\n");
+            continue;
+        }
+        if (filePtr == NULL) {
+            continue;   //Data of an entry that could not be created
+        }
+        if (written + dataSize > entry.size) {
+            dataSize = entry.size - written;
+        }
+        fwrite(output, dataSize, 1, filePtr);
+        written += dataSize;
+        bytes += dataSize;
+    }
+    if (filePtr != NULL) {
+        finishEntry(filePtr, &entry, written);
+    }
+    finishDirectories(root, directories, directoryCount);
+    free(directories);
+    printf("Disconnecting\n");
+    llclose(TRUE);
+    printf("Batch received: %lld files, %lld bytes\n", files, bytes);
+    printTransferStatistics(options, NULL);
+}
+
+//Resumable transfers: with APP_RESUME set, the START packet also carries the file's modification time.
+//The receiver keeps a checkpoint next to the file it writes: the source's size and time, how many
+//bytes are safely in the file and their CRC-32. It answers START with a RESUME packet holding that
+//offset and CRC, once its own copy still matches them. The transmitter checks the CRC against its
+//file and answers with the offset it goes on from, 0 when they differ: three packets in all.
+#define CHECKPOINT_INTERVAL 4096    //File bytes between checkpoints
+
+typedef struct {
+    const char *filename;   //Of the copy being received
+    long long fileSize;     //Identity of the source file
+    long long mtime;
+    long mtimeNs;
+    long long offset;       //Bytes of the file already written
+    unsigned int crc;       //CRC-32 register over them
+    long long saved;        //offset when the checkpoint was last written
+} Checkpoint;
+
+void checkpointPath(char *path, const char *filename) {
+    snprintf(path, PATH_MAX, "%s.resume", filename);
+}
+
+int loadCheckpoint(const char *filename, Checkpoint *checkpoint) {
+    char path[PATH_MAX];
+    checkpointPath(path, filename);
+    checkpoint->filename = filename;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int fields = fscanf(file, "%lld %lld %ld %lld %x", &checkpoint->fileSize, &checkpoint->mtime,
+                        &checkpoint->mtimeNs, &checkpoint->offset, &checkpoint->crc);
+    fclose(file);
+    return fields == 5 ? 0 : -1;
+}
+
+int saveCheckpoint(Checkpoint *checkpoint) {
+    //Written aside and renamed, a crash leaves either the old checkpoint or the new one
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 4];
+    checkpointPath(path, checkpoint->filename);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "%lld %lld %ld %lld %08x\n", checkpoint->fileSize, checkpoint->mtime,
+            checkpoint->mtimeNs, checkpoint->offset, checkpoint->crc);
+    if (fclose(file) != 0 || rename(temporary, path) != 0) {
+        return -1;
+    }
+    checkpoint->saved = checkpoint->offset;
+    return 0;
+}
+
+void checkpointStored(void *context, const unsigned char *data, int size, long long offset) {
+    //Storage callback, on the writer thread once the data is in the file, so the checkpoint never gets ahead of it
+    Checkpoint *checkpoint = context;
+    if (offset != checkpoint->offset) {
+        return;
+    }
+    checkpoint->crc = crc32Update(checkpoint->crc, data, size);
+    checkpoint->offset += size;
+    if (checkpoint->offset - checkpoint->saved >= CHECKPOINT_INTERVAL && saveCheckpoint(checkpoint) != 0) {
+        printf("Error saving the checkpoint\n");
+    }
+}
+
+unsigned int prefixCrc(FILE *filePtr, long long size) {
+    //CRC-32 register over the first size bytes, or ~CRC32_INIT if the file is shorter
+    unsigned char buffer[65536];
+    unsigned int crc = CRC32_INIT;
+    fseek(filePtr, 0, SEEK_SET);
+    while (size > 0) {
+        int chunk = size < (long long) sizeof(buffer) ? size : (int) sizeof(buffer);
+        if (fread(buffer, 1, chunk, filePtr) != chunk) {
+            return ~CRC32_INIT;
+        }
+        crc = crc32Update(crc, buffer, chunk);
+        size -= chunk;
+    }
+    return crc;
+}
+
+int createResumePacket(long long offset, unsigned int crc, unsigned char *resumePacket) {
+    //Returns the size of the resumePacket
+    resumePacket[0] = RESUME;
+    int i = putNumber(resumePacket, 1, RESUME_OFFSET, offset);
+    return putNumber(resumePacket, i, RESUME_CRC, crc);
+}
+
+int readResumePacket(long long *offset, unsigned int *crc, const unsigned char *resumePacket, int size) {
+    //Returns -1 if the packet is not a RESUME packet
+    int length;
+    const unsigned char *value;
+    if (size < 1 || resumePacket[0] != RESUME) {
+        return -1;
+    }
+    *offset = (value = findField(resumePacket, size, RESUME_OFFSET, &length)) != NULL ? getNumber(value, length) : 0;
+    *crc = (value = findField(resumePacket, size, RESUME_CRC, &length)) != NULL ? getNumber(value, length) : CRC32_INIT;
+    return 0;
+}
+
+long long resumeTransmitter(FILE *filePtr, long long fileSize) {
+    //After START: checks the receiver's offer against the file and leaves filePtr where sending goes on
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    long long offset = 0;
+    unsigned int crc;
+    int size = llread(packet);
+    if (size <= 0 || readResumePacket(&offset, &crc, packet, size) != 0) {
+        printf("Error receiving the resume packet\n");
+        offset = 0;
+    }
+    else if (offset > fileSize || prefixCrc(filePtr, offset) != crc) {
+        printf("The receiver's copy does not match the file, starting over\n");
+        offset = 0;
+    }
+    size = createResumePacket(offset, 0, packet);
+    if (llwrite(packet, size) == -1) {
+        printf("Error sending the resume packet\n");
+    }
+    fseek(filePtr, offset, SEEK_SET);
+    if (offset > 0) {
+        printf("Resuming at byte %lld of %lld\n", offset, fileSize);
+    }
+    return offset;
+}
+
+long long resumeReceiver(const char *filename, const unsigned char *startPacket, int startSize, int fileSize, Checkpoint *checkpoint) {
+    //After START: offers the checkpoint if it belongs to this source file and the copy on disk still
+    //matches it. Returns the offset the transmitter agreed to, checkpoint then holds that point.
+    Checkpoint current = {filename, fileSize, 0, 0, 0, CRC32_INIT, 0};
+    int length;
+    const unsigned char *value;
+    if ((value = findField(startPacket, startSize, FILE_MTIME, &length)) != NULL) {
+        current.mtime = getNumber(value, length);
+    }
+    if ((value = findField(startPacket, startSize, FILE_MTIME_NS, &length)) != NULL) {
+        current.mtimeNs = getNumber(value, length);
+    }
+    Checkpoint saved;
+    FILE *copy;
+    if (loadCheckpoint(filename, &saved) != 0) {
+        //Nothing to resume
+    }
+    else if (saved.fileSize != current.fileSize || saved.mtime != current.mtime || saved.mtimeNs != current.mtimeNs
+             || saved.offset > fileSize || (copy = fopen(filename, "rb")) == NULL) {
+        printf("The checkpoint is for another version of the file, starting over\n");
+    }
+    else {
+        if (prefixCrc(copy, saved.offset) == saved.crc) {
+            current = saved;
+        }
+        else {
+            printf("The local copy does not match the checkpoint, starting over\n");
+        }
+        fclose(copy);
+    }
+    *checkpoint = current;
+    checkpoint->saved = checkpoint->offset;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int size = createResumePacket(current.offset, current.crc, packet);
+    long long offset = 0;
+    unsigned int crc;
+    if (llwrite(packet, size) == -1) {
+        printf("Error sending the resume packet\n");
+    }
+    else if ((size = llread(packet)) <= 0 || readResumePacket(&offset, &crc, packet, size) != 0) {
+        printf("Error receiving the resume packet\n");
+        offset = 0;
+    }
+    if (offset != current.offset) {
+        offset = 0;
+        checkpoint->offset = 0;
+        checkpoint->crc = CRC32_INIT;
+        checkpoint->saved = 0;
+    }
+    if (offset > 0) {
+        printf("Resuming at byte %lld of %d\n", offset, fileSize);
+    }
+    return offset;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename) {
     LinkLayer connectionParameters;
@@ -123,19 +1354,93 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
 
+    memset(&transfer, 0, sizeof(transfer));
+    clock_gettime(CLOCK_MONOTONIC, &transfer.start);
+    char ports[BOND_MAX_LINKS][50];
+    int links = bondPorts(serialPort, ports);
+
     if (connectionParameters.role == LlTx) {  //Transmitter
-        setupTransmitter(connectionParameters, "penguin.gif");
+        //Compression is the transmitter's choice, the START packet tells the receiver
+        const char *compress = getenv("APP_COMPRESS");
+        int options = compress != NULL && compress[0] != '\0' && compress[0] != '0' ? OPTION_COMPRESSION : 0;
+        if (compress != NULL && strcmp(compress, "block") == 0) {
+            options = OPTION_BLOCKS;
+        }
+        const char *pipeline = getenv("APP_PIPELINE");
+        int pipelined = pipeline != NULL && pipeline[0] != '\0' && pipeline[0] != '0';
+        if (pipelined && (options & OPTION_BLOCKS)) {
+            printf("The compression workers already read ahead, APP_PIPELINE is not needed\n");
+            pipelined = FALSE;
+        }
+        const char *resume = getenv("APP_RESUME");
+        if (resume != NULL && resume[0] != '\0' && resume[0] != '0') {
+            if (options & OPTION_BLOCKS) {
+                printf("Block transfers are not resumable, starting from byte 0\n");
+            }
+            else {
+                options |= OPTION_RESUME;
+            }
+        }
+        struct stat info;
+        if (stat(filename, &info) == 0 && S_ISDIR(info.st_mode)) {
+            if (links > 1) {
+                printf("Directories are not striped, sending over %s only\n", serialPort);
+            }
+            if (options & OPTION_BLOCKS) {
+                printf("Files are sent one after the other, each packet is compressed instead of blocks\n");
+                options = OPTION_COMPRESSION;
+            }
+            sendBatch(connectionParameters, filename, (options & ~OPTION_RESUME) | OPTION_BATCH);
+            return;
+        }
+        if (links > 1) {
+            if (options & OPTION_BLOCKS) {
+                printf("Blocks are not striped, bonded links compress each packet instead\n");
+                options = OPTION_COMPRESSION;
+            }
+            FILE *filePtr = fopen(filename, "rb");
+            if (filePtr == NULL) {
+                printf("File is not in the correct place/doesn't exist\n");
+                return;
+            }
+            options &= ~OPTION_RESUME;
+            runBond(connectionParameters, ports, links, fileno(filePtr), findSize(filename), &options);
+            fclose(filePtr);
+            printf("Penguin sent\n");
+            printTransferStatistics(options, NULL);
+            return;
+        }
+        setupTransmitter(connectionParameters, filename, options);
         printf("setup done\n");
         FILE *filePtr;
-        filePtr = fopen("penguin.gif", "rb");
+        filePtr = fopen(filename, "rb");
         unsigned char frame[FRAME_SIZE];
         unsigned char input[INPUT_SIZE];
         int counter = 0;
-        while (!feof(filePtr)) {
-            printf("Sent a frame\n");
-            fread(input, INPUT_SIZE, 1, filePtr);
-            createDataPacket(counter, INPUT_SIZE, frame, input);
-            if (llwrite(frame, INPUT_SIZE + 4) == -1) {
+        long long offset = 0;
+        if (options & OPTION_RESUME) {
+            offset = resumeTransmitter(filePtr, findSize(filename));
+            counter = offset / INPUT_SIZE;
+        }
+        if (pipelined && sendPipelined(filePtr, &counter, options) != 0) {
+            printf("Error starting the reader thread, reading on this thread\n");
+            pipelined = FALSE;
+        }
+        if (options & OPTION_BLOCKS) {
+            sendBlocks(filePtr, findSize(filename), &counter);
+        }
+        else if (!pipelined && !(options & OPTION_COMPRESSION)) {     //Frames are built from the file's pages, no stdio on the way
+            if (llsendfile(fileno(filePtr), offset, findSize(filename) - offset, INPUT_SIZE, dataPacketHeader, &counter) == -1) {
+                printf("Error sending the file\n");
+            }
+        }
+        while ((options & OPTION_COMPRESSION) && !pipelined) {
+            int dataSize = fread(input, 1, INPUT_SIZE, filePtr);
+            if (dataSize <= 0) {
+                break;
+            }
+            int size = createDataPacket(counter, dataSize, options & OPTION_COMPRESSION, frame, input);
+            if (llwrite(frame, size) == -1) {
                 printf("Error sending data packet\n");
             }
             counter++;
@@ -144,51 +1449,131 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         printf("Penguin sent\n");
 
         //Send control packet
-        int size = createControlPacket(END,findSize(filename),frame);
+        int size = createControlPacket(END,findSize(filename),0,frame);
         if (llwrite(frame, size) == -1) {
             printf("Error sending final control packet\n");
         }
         printf("Final control packet sent\n");
 
-        if (llclose(0) == -1) {
+        if (llclose(TRUE) == -1) {
             printf("Error in llclose\n");
         }
+        printTransferStatistics(options, options & OPTION_BLOCKS ? &transfer.blocks : NULL);
     }
     else if (connectionParameters.role == LlRx) { //Receiver
         int fileSize;
         unsigned char frame[FRAME_SIZE];
         unsigned char output[FRAME_SIZE];
         FILE *filePtr;
-        filePtr = fopen("penguin.gif", "wb");
-        setupReceiver(connectionParameters, &fileSize);
+        int options = 0;
+        if (links > 1) {
+            filePtr = fopen(filename, "wb");
+            runBond(connectionParameters, ports, links, fileno(filePtr), -1, &options);
+            fclose(filePtr);
+            printf("Transfer complete\n");
+            printTransferStatistics(options, NULL);
+            return;
+        }
+        unsigned char start[FRAME_SIZE];
+        int startSize;
+        setupReceiver(connectionParameters, &fileSize, &options, start, &startSize);
+        if (options & OPTION_BATCH) {
+            receiveBatch(filename, options);
+            return;
+        }
+        Checkpoint checkpoint;
+        long long resumed = options & OPTION_RESUME ? resumeReceiver(filename, start, startSize, fileSize, &checkpoint) : 0;
+        filePtr = fopen(filename, resumed > 0 ? "r+b" : "wb");
+        if (resumed > 0) {  //Bytes after the checkpoint come again
+            ftruncate(fileno(filePtr), resumed);
+        }
+        BlockPipeline *pipeline = NULL;
+        Storage *storage = NULL;
+        StorageStatistics storageStats;
+        if (options & OPTION_BLOCKS) {  //Blocks are decompressed and written by the workers as they complete
+            pipeline = startDecompression(fileno(filePtr), pipelineWorkers());
+            if (pipeline == NULL) {
+                printf("Error starting the decompression workers\n");
+            }
+        }
+        else {  //Packets are gathered into blocks and written off this thread, at their offsets
+            storage = openStorage(fileno(filePtr), fileSize, syncPolicy(), pipelineMemory() / STORAGE_BLOCK_SIZE,
+                                  options & OPTION_RESUME ? checkpointStored : NULL, &checkpoint);
+            if (storage == NULL) {
+                printf("Error starting the storage writer, writing each packet directly\n");
+            }
+        }
 
-        int filledSize = 0;
+        int filledSize = resumed;
 
         while (1) {
             if (llread(frame) == -1) {
                 printf("Error receiving data packet\n");
 
             } else if (frame[0] == END) {  //Last control packet
+                if (pipeline != NULL && finishPipeline(pipeline, &transfer.blocks) != 0) {
+                    printf("Error decompressing the file\n");
+                }
+                if (storage != NULL && closeStorage(storage, &storageStats) != 0) {
+                    printf("Error writing the file\n");
+                }
                 fclose(filePtr);
+                if (options & OPTION_RESUME) {  //Complete, nothing to resume
+                    char path[PATH_MAX];
+                    checkpointPath(path, filename);
+                    remove(path);
+                }
                 printf("Transfer complete\n");
                 llread(frame); //Receive DISC
                 printf("Disconnecting\n");
+                llclose(TRUE);
                 printf("File Size: %i\n", fileSize);
+                printTransferStatistics(options, pipeline != NULL ? &transfer.blocks : NULL);
+                if (storage != NULL) {
+                    printStorageStatistics(&storageStats);
+                }
                 break;
             }
             int sequenceNumber;
             int size;
-            readDataPacket(&sequenceNumber, &size, frame, output);
+            if ((frame[0] & ~COMPRESSED) == SEGMENT) {     //A bonded transmitter whose other links found no receiver
+                long long offset;
+                if (readSegmentPacket(&offset, &size, frame, output) == -1
+                    || (storage != NULL ? storeAt(storage, output, size, offset) : writeAt(fileno(filePtr), output, size, offset)) != 0) {
+                    printf("Error in segment packet\n");
+                }
+                continue;
+            }
+            if (readDataPacket(&sequenceNumber, &size, frame, output) == -1) {
+                printf("Error decompressing data packet\n");
+                continue;
+            }
+
+            if (pipeline != NULL) {
+                if (feedBlocks(pipeline, output, size) == -1) {
+                    printf("Error in the compressed stream\n");
+                }
+                continue;
+            }
 
             printf("FILLING: %i bytes with %i new bytes", filledSize, size);
+            int offset = filledSize;
             filledSize = filledSize + size;
             printf(". Result: %i\n", filledSize);
 
             if (filledSize > fileSize) {
-                fwrite(output, (size -(filledSize - fileSize)), 1, filePtr);
+                size = size - (filledSize - fileSize);
             }
-            else {
-                fwrite(output, size, 1, filePtr);
+            if (storage != NULL) {
+                if (storeAt(storage, output, size, offset) != 0) {
+                    printf("Error writing the file\n");
+                }
+            }
+            else if (writeAt(fileno(filePtr), output, size, offset) != 0) {
+                printf("Error writing the file\n");
+            }
+            else if (options & OPTION_RESUME) {
+                checkpointStored(&checkpoint, output, size, offset);
             }
 
             printf("Succesfully wrote %i frame\n", sequenceNumber);
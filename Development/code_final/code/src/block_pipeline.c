@@ -0,0 +1,379 @@
+// Block pipeline: a ring of slots shared by the link thread and the workers.
+// Transmitter slots go FREE -> QUEUED -> WORKING -> DONE and back to FREE once the
+// link thread has sent them, block i always in slot i % slots so they come out in order.
+// Receiver slots go FREE -> FILLING -> QUEUED -> WORKING -> FREE, the workers write
+// their block at its offset with pwrite() so any order will do.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "block_pipeline.h"
+#include "lzh.h"
+
+enum SLOT_STATE {FREE = 0, FILLING, QUEUED, WORKING, DONE};
+enum BLOCK_METHOD {STORED = 0, LZH};
+
+typedef struct {
+    int state;
+    long long index;
+    int method;
+    int original;
+    int stored;
+    int fill;               //Receiver: stored bytes received so far
+    unsigned char *data;    //Header and stored bytes
+} Slot;
+
+struct BlockPipeline {
+    int compressing;
+    int fd;
+    long long fileSize;
+    long long blockCount;
+    int workers;
+    pthread_t threads[PIPELINE_MAX_WORKERS];
+    unsigned char *scratch[PIPELINE_MAX_WORKERS];   //Worker input (transmitter) or output (receiver)
+    int slotCount;
+    Slot *slots;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    //A slot was queued, or stop
+    pthread_cond_t done;    //A worker finished a slot
+    long long nextQueue;    //Transmitter: next block to hand to the workers
+    long long nextSend;     //Transmitter: next block for the link
+    long long nextIndex;    //Receiver: index of the block being filled
+    Slot *filling;
+    unsigned char header[PIPELINE_HEADER_SIZE];
+    int headerFill;
+    int stop;
+    atomic_int failed;      //Also read by the link thread outside the lock
+    PipelineStatistics stats;
+};
+
+typedef struct {
+    BlockPipeline *pipeline;
+    int id;
+} WorkerArgument;
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void writeHeader(unsigned char *header, int method, int original, int stored) {
+    header[0] = method;
+    for (int i = 0; i < 4; i++) {
+        header[1 + i] = original >> (24 - 8 * i);
+        header[5 + i] = stored >> (24 - 8 * i);
+    }
+}
+
+static int readSize(const unsigned char *bytes) {
+    return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static int compressSlot(BlockPipeline *p, Slot *slot, unsigned char *input) {
+    long long offset = slot->index * PIPELINE_BLOCK_SIZE;
+    int size = p->fileSize - offset < PIPELINE_BLOCK_SIZE ? p->fileSize - offset : PIPELINE_BLOCK_SIZE;
+    for (int done = 0; done < size;) {
+        ssize_t n = pread(p->fd, input + done, size - done, offset + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    slot->original = size;
+    slot->method = LZH;
+    slot->stored = lzhCompress(slot->data + PIPELINE_HEADER_SIZE, PIPELINE_BLOCK_SIZE, input, size);
+    if (slot->stored < 0) {
+        slot->method = STORED;
+        slot->stored = size;
+        memcpy(slot->data + PIPELINE_HEADER_SIZE, input, size);
+    }
+    writeHeader(slot->data, slot->method, slot->original, slot->stored);
+    return 0;
+}
+
+static int decompressSlot(BlockPipeline *p, Slot *slot, unsigned char *output) {
+    const unsigned char *block = slot->data + PIPELINE_HEADER_SIZE;
+    if (slot->method == LZH) {
+        if (lzhDecompress(output, PIPELINE_BLOCK_SIZE, block, slot->stored) != slot->original) {
+            return -1;
+        }
+        block = output;
+    }
+    long long offset = slot->index * PIPELINE_BLOCK_SIZE;
+    for (int done = 0; done < slot->original;) {
+        ssize_t n = pwrite(p->fd, block + done, slot->original - done, offset + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static Slot *queuedSlot(BlockPipeline *p) {
+    //Oldest queued block first, the link needs it soonest
+    Slot *oldest = NULL;
+    for (int i = 0; i < p->slotCount; i++) {
+        if (p->slots[i].state == QUEUED && (oldest == NULL || p->slots[i].index < oldest->index)) {
+            oldest = &p->slots[i];
+        }
+    }
+    return oldest;
+}
+
+static void *worker(void *argument) {
+    BlockPipeline *p = ((WorkerArgument *) argument)->pipeline;
+    unsigned char *scratch = p->scratch[((WorkerArgument *) argument)->id];
+    free(argument);
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        Slot *slot;
+        while ((slot = queuedSlot(p)) == NULL && !p->stop) {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        if (slot == NULL) {
+            break;  //Stopped with nothing left to do
+        }
+        slot->state = WORKING;
+        pthread_mutex_unlock(&p->lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        int result = p->compressing ? compressSlot(p, slot, scratch) : decompressSlot(p, slot, scratch);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        pthread_mutex_lock(&p->lock);
+        p->stats.workerSeconds += elapsed(&start, &end);
+        if (result != 0) {
+            p->failed = 1;
+        }
+        if (p->compressing) {
+            p->stats.blocks++;
+            p->stats.rawBlocks += slot->method == STORED;
+            p->stats.originalBytes += slot->original;
+            p->stats.storedBytes += PIPELINE_HEADER_SIZE + slot->stored;
+            slot->state = DONE;
+        }
+        else {
+            slot->state = FREE;
+        }
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static BlockPipeline *startPipeline(int fd, int workers, int compressing) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    else if (workers > PIPELINE_MAX_WORKERS) {
+        workers = PIPELINE_MAX_WORKERS;
+    }
+    BlockPipeline *p = calloc(1, sizeof(BlockPipeline));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->compressing = compressing;
+    p->fd = fd;
+    p->slotCount = 2 * workers;
+    p->slots = calloc(p->slotCount, sizeof(Slot));
+    int ok = p->slots != NULL;
+    for (int i = 0; ok && i < p->slotCount; i++) {
+        p->slots[i].data = malloc(PIPELINE_HEADER_SIZE + PIPELINE_BLOCK_SIZE);
+        ok = p->slots[i].data != NULL;
+    }
+    for (int i = 0; ok && i < workers; i++) {
+        p->scratch[i] = malloc(PIPELINE_BLOCK_SIZE);
+        ok = p->scratch[i] != NULL;
+    }
+    atomic_init(&p->failed, 0);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (int i = 0; ok && i < workers; i++) {
+        WorkerArgument *argument = malloc(sizeof(WorkerArgument));
+        ok = argument != NULL;
+        if (ok) {
+            argument->pipeline = p;
+            argument->id = i;
+            ok = pthread_create(&p->threads[i], NULL, worker, argument) == 0;
+            if (!ok) {
+                free(argument);
+            }
+        }
+        if (ok) {
+            p->workers++;
+        }
+    }
+    if (!ok) {
+        finishPipeline(p, NULL);
+        return NULL;
+    }
+    return p;
+}
+
+static void queueBlocks(BlockPipeline *p) {
+    //Called with the lock held
+    while (p->nextQueue < p->blockCount && p->nextQueue < p->nextSend + p->slotCount) {
+        Slot *slot = &p->slots[p->nextQueue % p->slotCount];
+        slot->state = QUEUED;
+        slot->index = p->nextQueue++;
+    }
+    pthread_cond_broadcast(&p->work);
+}
+
+BlockPipeline *startCompression(int fd, long long fileSize, int workers) {
+    BlockPipeline *p = startPipeline(fd, workers, 1);
+    if (p != NULL) {
+        pthread_mutex_lock(&p->lock);
+        p->fileSize = fileSize;
+        p->blockCount = (fileSize + PIPELINE_BLOCK_SIZE - 1) / PIPELINE_BLOCK_SIZE;
+        queueBlocks(p);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return p;
+}
+
+const unsigned char *nextBlock(BlockPipeline *p, int *size) {
+    pthread_mutex_lock(&p->lock);
+    Slot *slot = &p->slots[p->nextSend % p->slotCount];
+    if (p->nextSend >= p->blockCount) {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (slot->state != DONE && !p->failed) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    p->stats.stallSeconds += elapsed(&start, &end);
+    int failed = p->failed;
+    pthread_mutex_unlock(&p->lock);
+    if (failed) {
+        return NULL;
+    }
+    *size = PIPELINE_HEADER_SIZE + slot->stored;
+    return slot->data;
+}
+
+void releaseBlock(BlockPipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    p->slots[p->nextSend % p->slotCount].state = FREE;
+    p->nextSend++;
+    queueBlocks(p);
+    pthread_mutex_unlock(&p->lock);
+}
+
+BlockPipeline *startDecompression(int fd, int workers) {
+    return startPipeline(fd, workers, 0);
+}
+
+static Slot *freeSlot(BlockPipeline *p) {
+    //Waits while every slot is busy: the link slows down to the workers
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&p->lock);
+    Slot *slot = NULL;
+    while (slot == NULL && !p->failed) {
+        for (int i = 0; i < p->slotCount && slot == NULL; i++) {
+            if (p->slots[i].state == FREE) {
+                slot = &p->slots[i];
+            }
+        }
+        if (slot == NULL && !p->failed) {
+            pthread_cond_wait(&p->done, &p->lock);
+        }
+    }
+    if (slot != NULL) {
+        slot->state = FILLING;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    p->stats.stallSeconds += elapsed(&start, &end);
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+int feedBlocks(BlockPipeline *p, const unsigned char *data, int size) {
+    while (size > 0) {
+        if (p->failed) {
+            return -1;
+        }
+        if (p->headerFill < PIPELINE_HEADER_SIZE) {
+            int n = PIPELINE_HEADER_SIZE - p->headerFill < size ? PIPELINE_HEADER_SIZE - p->headerFill : size;
+            memcpy(p->header + p->headerFill, data, n);
+            p->headerFill += n;
+            data += n;
+            size -= n;
+            if (p->headerFill < PIPELINE_HEADER_SIZE) {
+                break;
+            }
+            int method = p->header[0];
+            int original = readSize(p->header + 1);
+            int stored = readSize(p->header + 5);
+            if (method > LZH || original <= 0 || original > PIPELINE_BLOCK_SIZE || stored <= 0
+                || stored > PIPELINE_BLOCK_SIZE || (method == STORED && stored != original)) {
+                p->failed = 1;
+                return -1;
+            }
+            p->filling = freeSlot(p);
+            if (p->filling == NULL) {
+                return -1;
+            }
+            p->filling->method = method;
+            p->filling->original = original;
+            p->filling->stored = stored;
+            p->filling->fill = 0;
+            continue;
+        }
+        Slot *slot = p->filling;
+        int n = slot->stored - slot->fill < size ? slot->stored - slot->fill : size;
+        memcpy(slot->data + PIPELINE_HEADER_SIZE + slot->fill, data, n);
+        slot->fill += n;
+        data += n;
+        size -= n;
+        if (slot->fill == slot->stored) {
+            pthread_mutex_lock(&p->lock);
+            slot->index = p->nextIndex++;
+            slot->state = QUEUED;
+            p->stats.blocks++;
+            p->stats.rawBlocks += slot->method == STORED;
+            p->stats.originalBytes += slot->original;
+            p->stats.storedBytes += PIPELINE_HEADER_SIZE + slot->stored;
+            pthread_cond_broadcast(&p->work);
+            pthread_mutex_unlock(&p->lock);
+            p->filling = NULL;
+            p->headerFill = 0;
+        }
+    }
+    return 0;
+}
+
+int finishPipeline(BlockPipeline *p, PipelineStatistics *stats) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->workers; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    int result = p->failed || p->headerFill != 0 ? -1 : 0;
+    if (stats != NULL) {
+        *stats = p->stats;
+    }
+    for (int i = 0; i < PIPELINE_MAX_WORKERS; i++) {
+        free(p->scratch[i]);
+    }
+    for (int i = 0; p->slots != NULL && i < p->slotCount; i++) {
+        free(p->slots[i].data);
+    }
+    free(p->slots);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    free(p);
+    return result;
+}
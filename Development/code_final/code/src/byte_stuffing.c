@@ -0,0 +1,362 @@
+// Byte stuffing, vectorized where the CPU allows it.
+// Blocks of 16 (SSE2) or 32 (AVX2) bytes are compared against FLAG and ESCAPE at once,
+// and XORed into an accumulator so the BCC comes out of the same pass:
+// clean blocks are stored whole, sparse blocks copy their clean runs in bulk, blocks made
+// only of FLAG/ESCAPE are expanded with unpack instructions and other dense blocks go scalar.
+// Destuffing works in place: blocks are searched for ESCAPE and the clean spans between
+// escapes are moved down over the bytes the escapes freed.
+
+#include <pthread.h>
+#include <string.h>
+#include "byte_stuffing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFFING_X86 1
+#endif
+
+static int stuffScalar(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc) {
+    int t = 0;
+    unsigned char check = 0;
+    for (int i = 0; i < size; i++) {
+        check ^= src[i];
+        if (src[i] == STUFF_FLAG || src[i] == STUFF_ESCAPE) {
+            dst[t++] = STUFF_ESCAPE;
+            dst[t++] = src[i] ^ STUFF_XOR;
+        }
+        else {
+            dst[t++] = src[i];
+        }
+    }
+    *bcc = check;
+    return t;
+}
+
+static int stuffMarkedBlock(unsigned char *dst, const unsigned char *src, int blockSize, unsigned int mask) {
+    //mask has one bit per byte of the block that must be escaped
+    int t = 0;
+    int pos = 0;
+    while (mask != 0) {
+        int marked = __builtin_ctz(mask);
+        memcpy(dst + t, src + pos, marked - pos);
+        t += marked - pos;
+        dst[t++] = STUFF_ESCAPE;
+        dst[t++] = src[marked] ^ STUFF_XOR;
+        pos = marked + 1;
+        mask &= mask - 1;
+    }
+    memcpy(dst + t, src + pos, blockSize - pos);
+    return t + blockSize - pos;
+}
+
+static int destuffRange(unsigned char *dst, const unsigned char *src, int *read, int *written, int end, int size, unsigned char *check) {
+    //Scalar destuffing from src[*read] up to end, an escape at end - 1 takes its pair from beyond end
+    int i = *read;
+    int t = *written;
+    unsigned char result = *check;
+    while (i < end) {
+        if (src[i] == STUFF_ESCAPE) {
+            if (i + 1 >= size || (src[i + 1] != (STUFF_FLAG ^ STUFF_XOR) && src[i + 1] != (STUFF_ESCAPE ^ STUFF_XOR))) {
+                return -1;
+            }
+            dst[t] = src[i + 1] ^ STUFF_XOR;
+            i += 2;
+        }
+        else {
+            dst[t] = src[i++];
+        }
+        result ^= dst[t++];
+    }
+    *read = i;
+    *written = t;
+    *check = result;
+    return 0;
+}
+
+static int destuffMarkedBlock(unsigned char *dst, const unsigned char *src, int *read, int *written, int blockSize, unsigned int mask, int size, unsigned char *check) {
+    //mask has one bit per ESCAPE in the block. A valid pair never ends in ESCAPE, so every bit starts a pair.
+    int i = *read;
+    int t = *written;
+    int start = t;
+    int pos = 0;
+    while (mask != 0) {
+        int marked = __builtin_ctz(mask);
+        if (marked < pos) {     //ESCAPE used as the second byte of a pair
+            return -1;
+        }
+        memmove(dst + t, src + i + pos, marked - pos);
+        t += marked - pos;
+        unsigned char escaped = i + marked + 1 < size ? src[i + marked + 1] : STUFF_ESCAPE;
+        if (escaped != (STUFF_FLAG ^ STUFF_XOR) && escaped != (STUFF_ESCAPE ^ STUFF_XOR)) {
+            return -1;
+        }
+        dst[t++] = escaped ^ STUFF_XOR;
+        pos = marked + 2;
+        mask &= mask - 1;
+    }
+    if (pos < blockSize) {
+        memmove(dst + t, src + i + pos, blockSize - pos);
+        t += blockSize - pos;
+        pos = blockSize;
+    }
+    for (int k = start; k < t; k++) {
+        *check ^= dst[k];
+    }
+    *read = i + pos;
+    *written = t;
+    return 0;
+}
+
+static int destuffScalar(unsigned char *dst, const unsigned char *src, int size, unsigned char *check) {
+    int i = 0;
+    int t = 0;
+    if (destuffRange(dst, src, &i, &t, size, size, check) != 0) {
+        return -1;
+    }
+    return t;
+}
+
+#ifdef STUFFING_X86
+__attribute__((target("sse2")))
+static unsigned char foldXorSse2(__m128i acc) {
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+    return (unsigned char) _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("sse2")))
+static int stuffSse2(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc) {
+    const __m128i flag = _mm_set1_epi8((char) STUFF_FLAG);
+    const __m128i escape = _mm_set1_epi8((char) STUFF_ESCAPE);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char blockCheck;
+    int i = 0;
+    int t = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (src + i));
+        acc = _mm_xor_si128(acc, block);
+        __m128i marked = _mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, escape));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(marked);
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *) (dst + t), block);
+            t += 16;
+        }
+        else if (mask == 0xffff) {
+            __m128i escaped = _mm_xor_si128(block, _mm_set1_epi8(STUFF_XOR));
+            _mm_storeu_si128((__m128i *) (dst + t), _mm_unpacklo_epi8(escape, escaped));
+            _mm_storeu_si128((__m128i *) (dst + t + 16), _mm_unpackhi_epi8(escape, escaped));
+            t += 32;
+        }
+        else if (__builtin_popcount(mask) > 4) {
+            t += stuffScalar(dst + t, src + i, 16, &blockCheck);
+        }
+        else {
+            t += stuffMarkedBlock(dst + t, src + i, 16, mask);
+        }
+    }
+    unsigned char tailCheck;
+    t += stuffScalar(dst + t, src + i, size - i, &tailCheck);
+    *bcc = foldXorSse2(acc) ^ tailCheck;
+    return t;
+}
+
+__attribute__((target("avx2")))
+static int stuffAvx2(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc) {
+    const __m256i flag = _mm256_set1_epi8((char) STUFF_FLAG);
+    const __m256i escape = _mm256_set1_epi8((char) STUFF_ESCAPE);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned char blockCheck;
+    int i = 0;
+    int t = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (src + i));
+        acc = _mm256_xor_si256(acc, block);
+        __m256i marked = _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, escape));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(marked);
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *) (dst + t), block);
+            t += 32;
+        }
+        else if (mask == 0xffffffff) {
+            //unpack works per 128-bit lane, so the lanes are reordered before storing
+            __m256i escaped = _mm256_xor_si256(block, _mm256_set1_epi8(STUFF_XOR));
+            __m256i low = _mm256_unpacklo_epi8(escape, escaped);
+            __m256i high = _mm256_unpackhi_epi8(escape, escaped);
+            _mm256_storeu_si256((__m256i *) (dst + t), _mm256_permute2x128_si256(low, high, 0x20));
+            _mm256_storeu_si256((__m256i *) (dst + t + 32), _mm256_permute2x128_si256(low, high, 0x31));
+            t += 64;
+        }
+        else if (__builtin_popcount(mask) > 8) {
+            t += stuffScalar(dst + t, src + i, 32, &blockCheck);
+        }
+        else {
+            t += stuffMarkedBlock(dst + t, src + i, 32, mask);
+        }
+    }
+    unsigned char tailCheck;
+    t += stuffSse2(dst + t, src + i, size - i, &tailCheck);
+    __m128i folded = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    *bcc = foldXorSse2(folded) ^ tailCheck;
+    return t;
+}
+
+__attribute__((target("sse2")))
+static int destuffSse2(unsigned char *dst, const unsigned char *src, int size, unsigned char *check) {
+    const __m128i escape = _mm_set1_epi8((char) STUFF_ESCAPE);
+    const __m128i escapedFlag = _mm_set1_epi16(STUFF_FLAG ^ STUFF_XOR);
+    const __m128i escapedEscape = _mm_set1_epi16(STUFF_ESCAPE ^ STUFF_XOR);
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    int t = 0;
+    while (i + 16 <= size) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (src + i));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(block, escape));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *) (dst + t), block);     //In place this ends below i + 16, already loaded
+            acc = _mm_xor_si128(acc, block);
+            i += 16;
+            t += 16;
+            continue;
+        }
+        if (mask == 0x5555) {   //Eight escape pairs: keep the odd bytes
+            __m128i escaped = _mm_srli_epi16(block, 8);
+            __m128i valid = _mm_or_si128(_mm_cmpeq_epi16(escaped, escapedFlag), _mm_cmpeq_epi16(escaped, escapedEscape));
+            if (_mm_movemask_epi8(valid) == 0xffff) {
+                __m128i packed = _mm_move_epi64(_mm_packus_epi16(escaped, escaped));
+                packed = _mm_xor_si128(packed, _mm_set_epi64x(0, 0x2020202020202020LL));
+                _mm_storel_epi64((__m128i *) (dst + t), packed);
+                acc = _mm_xor_si128(acc, packed);
+                i += 16;
+                t += 8;
+                continue;
+            }
+        }
+        if (destuffMarkedBlock(dst, src, &i, &t, 16, mask, size, check) != 0) {
+            return -1;
+        }
+    }
+    if (destuffRange(dst, src, &i, &t, size, size, check) != 0) {
+        return -1;
+    }
+    *check ^= foldXorSse2(acc);
+    return t;
+}
+
+__attribute__((target("avx2")))
+static int destuffAvx2(unsigned char *dst, const unsigned char *src, int size, unsigned char *check) {
+    const __m256i escape = _mm256_set1_epi8((char) STUFF_ESCAPE);
+    const __m256i escapedFlag = _mm256_set1_epi16(STUFF_FLAG ^ STUFF_XOR);
+    const __m256i escapedEscape = _mm256_set1_epi16(STUFF_ESCAPE ^ STUFF_XOR);
+    __m256i acc = _mm256_setzero_si256();
+    __m128i pairAcc = _mm_setzero_si128();
+    int i = 0;
+    int t = 0;
+    while (i + 32 <= size) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (src + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, escape));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *) (dst + t), block);
+            acc = _mm256_xor_si256(acc, block);
+            i += 32;
+            t += 32;
+            continue;
+        }
+        if (mask == 0x55555555) {
+            __m256i escaped = _mm256_srli_epi16(block, 8);
+            __m256i valid = _mm256_or_si256(_mm256_cmpeq_epi16(escaped, escapedFlag), _mm256_cmpeq_epi16(escaped, escapedEscape));
+            if ((unsigned int) _mm256_movemask_epi8(valid) == 0xffffffff) {
+                //packus works per 128-bit lane, the two useful quadwords are gathered before storing
+                __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(escaped, escaped), 0x08);
+                __m128i result = _mm_xor_si128(_mm256_castsi256_si128(packed), _mm_set1_epi8(STUFF_XOR));
+                _mm_storeu_si128((__m128i *) (dst + t), result);
+                pairAcc = _mm_xor_si128(pairAcc, result);
+                i += 32;
+                t += 16;
+                continue;
+            }
+        }
+        if (destuffMarkedBlock(dst, src, &i, &t, 32, mask, size, check) != 0) {
+            return -1;
+        }
+    }
+    unsigned char tailCheck = 0;
+    int tail = destuffSse2(dst + t, src + i, size - i, &tailCheck);
+    if (tail < 0) {
+        return -1;
+    }
+    __m128i folded = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    *check ^= foldXorSse2(_mm_xor_si128(folded, pairAcc)) ^ tailCheck;
+    return t + tail;
+}
+#endif
+
+static int (*stuffImpl)(unsigned char *, const unsigned char *, int, unsigned char *) = NULL;
+static int (*destuffImpl)(unsigned char *, const unsigned char *, int, unsigned char *) = NULL;
+static const char *stuffImplName = "scalar";
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;  //Links may run on several threads
+
+static void selectStuffing() {
+    stuffImpl = stuffScalar;
+    destuffImpl = destuffScalar;
+    stuffImplName = "scalar";
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        stuffImpl = stuffAvx2;
+        destuffImpl = destuffAvx2;
+        stuffImplName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        stuffImpl = stuffSse2;
+        destuffImpl = destuffSse2;
+        stuffImplName = "sse2";
+    }
+#endif
+}
+
+int stuffBytes(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc) {
+    pthread_once(&selectOnce, selectStuffing);
+    return stuffImpl(dst, src, size, bcc);
+}
+
+int destuffChunk(unsigned char *dst, const unsigned char *src, int size, int *escapePending, unsigned char *check) {
+    pthread_once(&selectOnce, selectStuffing);
+    int i = 0;
+    int t = 0;
+    if (*escapePending && size > 0) {   //The pair was split between chunks
+        if (src[0] != (STUFF_FLAG ^ STUFF_XOR) && src[0] != (STUFF_ESCAPE ^ STUFF_XOR)) {
+            return -1;
+        }
+        dst[t] = src[0] ^ STUFF_XOR;
+        *check ^= dst[t++];
+        *escapePending = 0;
+        i = 1;
+    }
+    int end = size;
+    if (end > i && src[end - 1] == STUFF_ESCAPE) {
+        end--;
+        *escapePending = 1;
+    }
+    int written = destuffImpl(dst + t, src + i, end - i, check);
+    if (written < 0) {
+        return -1;
+    }
+    return t + written;
+}
+
+int destuffBytes(unsigned char *buf, int size) {
+    int escapePending = 0;
+    unsigned char check = 0;
+    int written = destuffChunk(buf, buf, size, &escapePending, &check);
+    if (escapePending) {
+        return -1;
+    }
+    return written;
+}
+
+const char *stuffingImplementation() {
+    pthread_once(&selectOnce, selectStuffing);
+    return stuffImplName;
+}
@@ -0,0 +1,172 @@
+// LZ4 block format, greedy matching through a hash table of 4-byte sequences.
+// The table is sized to the input so short packets do not pay for clearing a large one.
+
+#include <string.h>
+#include <stdint.h>
+#include "compress.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     //The format ends on at least 5 literals
+#define MATCH_LIMIT 12      //and no match starts in the last 12 bytes
+#define MAX_OFFSET 65535
+#define MAX_HASH_LOG 14
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hashSequence(uint32_t sequence, int hashLog) {
+    return (sequence * 2654435761U) >> (32 - hashLog);
+}
+
+static unsigned char *writeLength(unsigned char *out, int length) {
+    //Lengths past the 4-bit token field continue in 255 steps
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+static int sequenceSize(int literals) {
+    //Bound on the output of a sequence before its match length bytes
+    return 1 + literals / 255 + 1 + literals + 2;
+}
+
+int compressBlock(unsigned char *dst, int dstCapacity, const unsigned char *src, int size) {
+    if (dstCapacity > size - 1) {
+        dstCapacity = size - 1;     //Anything larger is not worth it
+    }
+    if (dstCapacity <= 0) {
+        return -1;
+    }
+    int hashLog = 8;
+    while (hashLog < MAX_HASH_LOG && (1 << hashLog) < size) {
+        hashLog++;
+    }
+    int table[1 << MAX_HASH_LOG];
+    memset(table, -1, sizeof(int) << hashLog);
+
+    unsigned char *out = dst;
+    const unsigned char *outEnd = dst + dstCapacity;
+    int anchor = 0;
+    int pos = 0;
+    const int matchEnd = size - LAST_LITERALS;
+    while (pos + MATCH_LIMIT <= size) {
+        uint32_t sequence = read32(src + pos);
+        int h = hashSequence(sequence, hashLog);
+        int candidate = table[h];
+        table[h] = pos;
+        if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+            pos++;
+            continue;
+        }
+        //Extend backwards over literals, then forwards
+        while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+            pos--;
+            candidate--;
+        }
+        int length = MIN_MATCH;
+        while (pos + length < matchEnd && src[pos + length] == src[candidate + length]) {
+            length++;
+        }
+
+        int literals = pos - anchor;
+        if (out + sequenceSize(literals) + (length - MIN_MATCH) / 255 + 1 > outEnd) {
+            return -1;
+        }
+        unsigned char *token = out++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15) {
+            out = writeLength(out, literals - 15);
+        }
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        int offset = pos - candidate;
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        int extra = length - MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15) {
+            out = writeLength(out, extra - 15);
+        }
+
+        pos += length;
+        anchor = pos;
+        if (pos - 2 >= 0 && pos + MATCH_LIMIT <= size) {
+            table[hashSequence(read32(src + pos - 2), hashLog)] = pos - 2;
+        }
+    }
+
+    int literals = size - anchor;
+    if (out + sequenceSize(literals) - 2 > outEnd) {
+        return -1;
+    }
+    unsigned char *token = out++;
+    *token = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        out = writeLength(out, literals - 15);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    return out - dst;
+}
+
+static int readLength(const unsigned char **in, const unsigned char *inEnd, int length) {
+    //Continues a 4-bit length of 15, -1 past the end of the input
+    if (length != 15) {
+        return length;
+    }
+    unsigned char byte;
+    do {
+        if (*in >= inEnd) {
+            return -1;
+        }
+        byte = *(*in)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int decompressBlock(unsigned char *dst, int dstCapacity, const unsigned char *src, int size) {
+    const unsigned char *in = src;
+    const unsigned char *inEnd = src + size;
+    unsigned char *out = dst;
+    unsigned char *outEnd = dst + dstCapacity;
+    while (in < inEnd) {
+        int token = *in++;
+        int literals = readLength(&in, inEnd, token >> 4);
+        if (literals < 0 || literals > inEnd - in || literals > outEnd - out) {
+            return -1;
+        }
+        memcpy(out, in, literals);
+        out += literals;
+        in += literals;
+        if (in == inEnd) {
+            break;  //Last sequence has no match
+        }
+        if (inEnd - in < 2) {
+            return -1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int length = readLength(&in, inEnd, token & 15);
+        if (offset == 0 || offset > out - dst || length < 0 || length + MIN_MATCH > outEnd - out) {
+            return -1;
+        }
+        length += MIN_MATCH;
+        const unsigned char *match = out - offset;
+        if (offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        }
+        else {
+            for (int i = 0; i < length; i++) {  //Overlapping copy repeats the last offset bytes
+                *out++ = match[i];
+            }
+        }
+    }
+    return out - dst;
+}
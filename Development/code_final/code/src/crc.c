@@ -0,0 +1,163 @@
+// CRC-16 and CRC-32, reflected, eight bytes per table step (slice-by-8).
+// CRC-32 on long buffers uses carry-less multiplication when the CPU has it:
+// four 128-bit lanes are folded 64 bytes at a time, then reduced with Barrett's method
+// (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction").
+
+#include <pthread.h>
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+static unsigned short crc16Table[8][256];
+static unsigned int crc32Table[8][256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;   //Links may run on several threads
+static pthread_once_t implOnce = PTHREAD_ONCE_INIT;
+static unsigned int (*crc32Impl)(unsigned int, const unsigned char *, int) = 0;
+static const char *crcImplName = "slice-by-8";
+
+static void buildTables() {
+    for (int n = 0; n < 256; n++) {
+        unsigned short c16 = n;
+        unsigned int c32 = n;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ 0x8408 : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ 0xedb88320U : c32 >> 1;
+        }
+        crc16Table[0][n] = c16;
+        crc32Table[0][n] = c32;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int n = 0; n < 256; n++) {
+            crc16Table[k][n] = (crc16Table[k - 1][n] >> 8) ^ crc16Table[0][crc16Table[k - 1][n] & 0xff];
+            crc32Table[k][n] = (crc32Table[k - 1][n] >> 8) ^ crc32Table[0][crc32Table[k - 1][n] & 0xff];
+        }
+    }
+}
+
+static unsigned int load32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+unsigned short crc16Update(unsigned short crc, const unsigned char *data, int size) {
+    pthread_once(&tablesOnce, buildTables);
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        crc = crc16Table[7][data[i] ^ (crc & 0xff)] ^ crc16Table[6][data[i + 1] ^ (crc >> 8)]
+            ^ crc16Table[5][data[i + 2]] ^ crc16Table[4][data[i + 3]]
+            ^ crc16Table[3][data[i + 4]] ^ crc16Table[2][data[i + 5]]
+            ^ crc16Table[1][data[i + 6]] ^ crc16Table[0][data[i + 7]];
+    }
+    for (; i < size; i++) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+unsigned char crc8Update(unsigned char crc, const unsigned char *data, int size) {
+    //Bit at a time, it only ever sees a few bytes
+    for (int i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static unsigned int crc32Slice8(unsigned int crc, const unsigned char *data, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned int one = load32(data + i) ^ crc;
+        unsigned int two = load32(data + i + 4);
+        crc = crc32Table[7][one & 0xff] ^ crc32Table[6][(one >> 8) & 0xff]
+            ^ crc32Table[5][(one >> 16) & 0xff] ^ crc32Table[4][one >> 24]
+            ^ crc32Table[3][two & 0xff] ^ crc32Table[2][(two >> 8) & 0xff]
+            ^ crc32Table[1][(two >> 16) & 0xff] ^ crc32Table[0][two >> 24];
+    }
+    for (; i < size; i++) {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("pclmul,sse2")))
+static unsigned int crc32Pclmul(unsigned int crc, const unsigned char *data, int size) {
+    //Folding constants x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32), x^64 mod P, then P and floor(x^64 / P)
+    if (size < 64) {
+        return crc32Slice8(crc, data, size);
+    }
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data), _mm_cvtsi32_si128((int) crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *) (data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *) (data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *) (data + 48));
+    int i = 64;
+    for (; i + 64 <= size; i += 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), x5);
+        x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), x6);
+        x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), x7);
+        x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), x8);
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) (data + i)));
+        x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *) (data + i + 16)));
+        x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *) (data + i + 32)));
+        x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i *) (data + i + 48)));
+    }
+    //Four lanes into one, then the remaining 16 byte blocks
+    __m128i next[3] = {x2, x3, x4};
+    for (int lane = 0; lane < 3; lane++) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), next[lane]), x5);
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x5);
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) (data + i)));
+    }
+    //128 bits to 64, then Barrett reduction to 32
+    __m128i x2r = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+    x2r = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2r);
+    x2r = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    x2r = _mm_clmulepi64_si128(_mm_and_si128(x2r, low32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2r);
+    crc = (unsigned int) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+    return crc32Slice8(crc, data + i, size - i);
+}
+#endif
+
+static void selectCrc() {
+    crc32Impl = crc32Slice8;
+    crcImplName = "slice-by-8";
+#ifdef CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2")) {
+        crc32Impl = crc32Pclmul;
+        crcImplName = "pclmul";
+    }
+#endif
+}
+
+unsigned int crc32Update(unsigned int crc, const unsigned char *data, int size) {
+    pthread_once(&tablesOnce, buildTables);
+    pthread_once(&implOnce, selectCrc);
+    return crc32Impl(crc, data, size);
+}
+
+const char *crcImplementation() {
+    pthread_once(&implOnce, selectCrc);
+    return crcImplName;
+}
@@ -0,0 +1,241 @@
+// Reed-Solomon codes over GF(256), primitive polynomial x^8 + x^4 + x^3 + x^2 + 1,
+// generator roots alpha^0 .. alpha^(parity - 1), shortened to the codeword length.
+// Decoding: syndromes, Berlekamp-Massey for the error locator, Chien search for the
+// positions and Forney's formula for the values.
+// Polynomials are stored lowest degree first. Codeword byte p has locator alpha^(n - 1 - p).
+
+#include <pthread.h>
+#include <string.h>
+#include "fec.h"
+
+#define FIELD_SIZE 255
+
+static unsigned char gfExp[2 * FIELD_SIZE];
+static unsigned char gfLog[FIELD_SIZE + 1];
+static unsigned char generator[FEC_MAX_PARITY + 1][FEC_MAX_PARITY + 1];   //One per parity count
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;    //Links may run on several threads
+
+static void buildField() {
+    int x = 1;
+    for (int i = 0; i < FIELD_SIZE; i++) {
+        gfExp[i] = x;
+        gfExp[i + FIELD_SIZE] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+}
+
+static unsigned char gfMul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b) {
+    if (a == 0) {
+        return 0;
+    }
+    return gfExp[gfLog[a] + FIELD_SIZE - gfLog[b]];
+}
+
+static unsigned char gfPow(int power) {
+    //alpha^power for any integer power
+    power %= FIELD_SIZE;
+    if (power < 0) {
+        power += FIELD_SIZE;
+    }
+    return gfExp[power];
+}
+
+static void buildGenerators() {
+    //g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(parity - 1)), monic, for every parity count
+    for (int parity = 0; parity <= FEC_MAX_PARITY; parity++) {
+        unsigned char *g = generator[parity];
+        memset(g, 0, FEC_MAX_PARITY + 1);
+        g[0] = 1;
+        for (int i = 0; i < parity; i++) {
+            unsigned char root = gfPow(i);
+            for (int j = i + 1; j > 0; j--) {
+                g[j] = g[j - 1] ^ gfMul(g[j], root);
+            }
+            g[0] = gfMul(g[0], root);
+        }
+    }
+}
+
+static void buildTables() {
+    buildField();
+    buildGenerators();
+}
+
+static void encodeCodeword(unsigned char *parityOut, const unsigned char *data, int count, int stride, int parity) {
+    //Remainder of data(x) * x^parity divided by g(x), kept highest degree first in parityOut
+    const unsigned char *g = generator[parity];
+    unsigned char remainder[FEC_MAX_PARITY];
+    memset(remainder, 0, parity);
+    for (int i = 0; i < count; i++) {
+        unsigned char feedback = data[i * stride] ^ remainder[0];
+        memmove(remainder, remainder + 1, parity - 1);
+        remainder[parity - 1] = 0;
+        if (feedback != 0) {
+            int logFeedback = gfLog[feedback];
+            for (int j = 0; j < parity; j++) {
+                unsigned char coefficient = g[parity - 1 - j];
+                if (coefficient != 0) {
+                    remainder[j] ^= gfExp[logFeedback + gfLog[coefficient]];
+                }
+            }
+        }
+    }
+    memcpy(parityOut, remainder, parity);
+}
+
+static int decodeCodeword(unsigned char *codeword, int n, int parity) {
+    //Returns the number of corrected bytes, or -1
+    unsigned char syndromes[FEC_MAX_PARITY];
+    int clean = 1;
+    for (int j = 0; j < parity; j++) {
+        unsigned char root = gfPow(j);
+        unsigned char value = 0;
+        for (int p = 0; p < n; p++) {
+            value = gfMul(value, root) ^ codeword[p];
+        }
+        syndromes[j] = value;
+        if (value != 0) {
+            clean = 0;
+        }
+    }
+    if (clean) {
+        return 0;
+    }
+
+    //Berlekamp-Massey: shortest locator Lambda(x) generating the syndromes
+    unsigned char locator[FEC_MAX_PARITY + 1] = {1};
+    unsigned char previous[FEC_MAX_PARITY + 1] = {1};
+    int errors = 0;
+    int shift = 1;
+    unsigned char previousDiscrepancy = 1;
+    for (int k = 0; k < parity; k++) {
+        unsigned char discrepancy = syndromes[k];
+        for (int i = 1; i <= errors; i++) {
+            discrepancy ^= gfMul(locator[i], syndromes[k - i]);
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+        unsigned char scale = gfDiv(discrepancy, previousDiscrepancy);
+        unsigned char saved[FEC_MAX_PARITY + 1];
+        memcpy(saved, locator, sizeof(saved));
+        for (int i = 0; i + shift <= parity; i++) {
+            locator[i + shift] ^= gfMul(scale, previous[i]);
+        }
+        if (2 * errors <= k) {
+            errors = k + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        }
+        else {
+            shift++;
+        }
+    }
+    if (2 * errors > parity) {
+        return -1;
+    }
+
+    //Chien search: byte p is wrong when Lambda(alpha^-(n - 1 - p)) is zero
+    int positions[FEC_MAX_PARITY];
+    int found = 0;
+    for (int p = 0; p < n && found <= errors; p++) {
+        unsigned char inverse = gfPow(-(n - 1 - p));
+        unsigned char value = 0;
+        for (int i = errors; i >= 0; i--) {
+            value = gfMul(value, inverse) ^ locator[i];
+        }
+        if (value == 0) {
+            if (found == errors) {
+                return -1;
+            }
+            positions[found++] = p;
+        }
+    }
+    if (found != errors) {
+        return -1;  //Roots outside the shortened codeword
+    }
+
+    //Forney: e = X * Omega(X^-1) / Lambda'(X^-1), Omega(x) = S(x) Lambda(x) mod x^parity
+    unsigned char evaluator[FEC_MAX_PARITY];
+    for (int i = 0; i < parity; i++) {
+        unsigned char value = 0;
+        for (int j = 0; j <= i && j <= errors; j++) {
+            value ^= gfMul(locator[j], syndromes[i - j]);
+        }
+        evaluator[i] = value;
+    }
+    for (int e = 0; e < found; e++) {
+        unsigned char x = gfPow(n - 1 - positions[e]);
+        unsigned char inverse = gfPow(-(n - 1 - positions[e]));
+        unsigned char omega = 0;
+        for (int i = parity - 1; i >= 0; i--) {
+            omega = gfMul(omega, inverse) ^ evaluator[i];
+        }
+        unsigned char derivative = 0;   //Only odd terms survive in characteristic 2
+        for (int i = errors - (errors % 2 == 0); i >= 1; i -= 2) {
+            derivative = gfMul(derivative, gfMul(inverse, inverse)) ^ locator[i];
+        }
+        if (derivative == 0) {
+            return -1;
+        }
+        codeword[positions[e]] ^= gfMul(x, gfDiv(omega, derivative));
+    }
+    return found;
+}
+
+int fecEncode(unsigned char *parityOut, const unsigned char *data, int size, int parity, int depth) {
+    pthread_once(&tablesOnce, buildTables);
+    for (int c = 0; c < depth; c++) {
+        int count = c < size ? (size - c + depth - 1) / depth : 0;
+        encodeCodeword(parityOut + c * parity, data + c, count, depth, parity);
+    }
+    return depth * parity;
+}
+
+int fecDecode(unsigned char *block, int size, int parity, int depth) {
+    pthread_once(&tablesOnce, buildTables);
+    if (size < 0 || parity < 1 || parity > FEC_MAX_PARITY || depth < 1 || depth > FEC_MAX_DEPTH
+        || (size + depth - 1) / depth + parity > FIELD_SIZE) {
+        return -1;  //The size comes off the wire, a codeword must fit the buffer below
+    }
+    int corrected = 0;
+    for (int c = 0; c < depth; c++) {
+        //Gather the interleaved codeword, data first then its parity
+        unsigned char codeword[FIELD_SIZE];
+        int count = c < size ? (size - c + depth - 1) / depth : 0;
+        for (int i = 0; i < count; i++) {
+            codeword[i] = block[c + i * depth];
+        }
+        memcpy(codeword + count, block + size + c * parity, parity);
+        unsigned char expected[FEC_MAX_PARITY];
+        encodeCodeword(expected, codeword, count, 1, parity);
+        if (memcmp(expected, codeword + count, parity) == 0) {
+            continue;   //Re-encoding is cheaper than the syndromes when nothing is wrong
+        }
+        int fixed = decodeCodeword(codeword, count + parity, parity);
+        if (fixed < 0) {
+            return -1;
+        }
+        if (fixed > 0) {
+            for (int i = 0; i < count; i++) {
+                block[c + i * depth] = codeword[i];
+            }
+            memcpy(block + size + c * parity, codeword + count, parity);
+            corrected += fixed;
+        }
+    }
+    return corrected;
+}
@@ -6,27 +6,166 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "link_layer.h"
+#include "link_sendfile.h"
+#include "byte_stuffing.h"
+#include "crc.h"
+#include "fec.h"
+#include "cobs.h"
+#include "whiten.h"
+#include "serial_port.h"
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
+// included by <termios.h>. BAUDRATE holds the line until setBaudRate()
+// programs a rate that has no Bxxx constant.
 #define BAUDRATE B38400
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
 enum MACHINE {TRANSMITTER = 0, RECEIVER = 1};                                           //Machine constants
-enum HEADER_TYPE {INVALID = -1, INFO, SET, DISC, UA, RR, REJ};
+enum HEADER_TYPE {TIMEOUT = -2, INVALID = -1, INFO, SET, DISC, UA, RR, REJ, SREJ, INFO_ERROR};
+enum ARQ_MODE {STOP_AND_WAIT = 0, GO_BACK_N, SELECTIVE_REPEAT};
+enum FCS_MODE {FCS_BCC = 0, FCS_CRC16, FCS_CRC32};
+enum FRAMING_MODE {FRAMING_STUFFING = 0, FRAMING_COBS, FRAMING_LENGTH};
+enum PARAMETER {PARAM_ARQ = 1, PARAM_WINDOW, PARAM_FCS, PARAM_FEC_PARITY, PARAM_FEC_DEPTH, PARAM_MAX_PAYLOAD,  //Handshake TLV types
+    PARAM_FRAMING, PARAM_WHITENING};
 enum BYTE {FLAG = 0x7e, ESCAPE = 0x7d, ESC_FLAG = 0x5e, ESC_ESCAPE = 0x5d,              //Flag and byte stuffing
     A_TRANSMITTER_COMMAND = 0x03, A_RECEIVER_COMMAND = 0x01,                        //Address
     CNTRL_INFO_0 = 0x00, CNTRL_INFO_1 = 0x40, CNTRL_SET = 0x03, CNTRL_DISC = 0x0b,  //Control Commands
     CNTRL_UA = 0x07, CNTRL_RR_0 = 0x05, CNTRL_RR_1 = 0x85,
-    CNTRL_REJ_0 = 0x01, CNTRL_REJ_1 = 0x81};                                        //Control responses
+    CNTRL_REJ_0 = 0x01, CNTRL_REJ_1 = 0x81,                                         //Control responses
+    CNTRL_INFO_MOD8 = 0x00, CNTRL_RR_MOD8 = 0x05, CNTRL_REJ_MOD8 = 0x01,            //Modulo-8 bases, sequence ORed in
+    CNTRL_SREJ_MOD8 = 0x0d};
 
-int machine;    //0 if transmitter or 1 if receiver
+//Session state is per thread, so a process can run one link per thread
+__thread int machine;    //0 if transmitter or 1 if receiver
 #define MAX_ARRAY_SIZE 250
-int messageParity = 0;  //0 or 1, switches
-int alarmEnabled = 1;
-int fd;
+#define MAX_FCS_SIZE 4
+#define MAX_FEC_SIZE (FEC_MAX_PARITY * FEC_MAX_DEPTH)
+#define MASK_SIZE 1     //Whitening mask in front of the payload
+#define MAX_BODY_SIZE (MASK_SIZE + MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + MAX_FEC_SIZE)
+#define MAX_FRAME_SIZE (2 * MAX_BODY_SIZE + 6)    //Header, worst case stuffed payload + FCS + parity and flag
+#define EXTENDED_MODULUS 8
+__thread int fd;
+
+//Timers: selective repeat uses one per sequence number, the others one for the window,
+//one for SET/DISC and one for probing a link that is down. A single timerfd is kept armed
+//for the earliest deadline.
+enum TIMER_ID {WINDOW_TIMER = EXTENDED_MODULUS, CONTROL_TIMER, PROBE_TIMER, MAX_TIMERS};
+__thread long long timerDeadline[MAX_TIMERS];    //0 when the timer is not running
+__thread int timerFd = -1;
+
+//Receive ring: the parser takes bytes from memory, read() is only called when it is empty
+#define RX_RING_SIZE 4096   //Power of two
+__thread unsigned char rxRing[RX_RING_SIZE];
+__thread unsigned int rxRingHead = 0;    //Free-running indices, masked on access
+__thread unsigned int rxRingTail = 0;
+
+//Retransmission timeout, Jacobson/Karels estimator (microseconds)
+__thread long long srttUs = 0;
+__thread long long rttvarUs = 0;
+__thread long long rtoUs = 3000000;
+__thread long long rtoMinUs = 10000;
+__thread long long rtoMaxUs = 60000000;
+__thread long long initialRtoUs = 3000000;
+__thread int rttSamples = 0;
+
+//Link supervision: nRetransmissions timeouts in a row with nothing heard from the peer mean the
+//link is down. The window then stops, and the oldest frame in flight is sent alone as a probe at
+//intervals that double up to LL_PROBE_MAX. The first frame from the peer brings the link back up.
+__thread int maxTimeouts = 3;
+__thread int consecutiveTimeouts = 0;
+__thread int linkLost = FALSE;
+__thread long long probeUs = 0;
+__thread long long probeMaxUs = 1000000;
+__thread long long lastHeardUs = 0;      //Last valid frame from the peer
+__thread long long restoredUs = 0;       //When the link came back, 0 once the frames of the outage are confirmed
+__thread int stalledFrames = 0;          //Frames in flight during the outage still to be confirmed
+
+typedef struct {
+    int framesSent;
+    int retransmissions;
+    int timeouts;
+    int framesReceived;
+    int duplicatesReceived;
+    int rejSent;
+    int rejReceived;
+    int framesParsed;       //Every complete frame, supervision included
+    int fecCorrected;       //Bytes repaired by Reed-Solomon
+    int piggybacked;        //Acknowledgements carried by I frames instead of RR
+    long long bodyBytes;    //I frame payload, FCS and parity, as built
+    long long framedBytes;  //The same bodies once framed, header and flags left out
+    int framesMasked;       //I frames sent with a non-zero whitening mask
+    int outages;            //Times the link was declared down
+    int probes;
+    long long downUs;       //From the last frame heard before each outage to the first one after
+    long long recoveryUs;   //From the link coming back to the frames of the outage being confirmed
+    long long readCalls;
+    long long pollCalls;
+    long long bytesRead;
+} Statistics;
+__thread Statistics stats;
+
+//Link settings: read from the environment, then possibly changed by the SET/UA negotiation
+typedef struct {
+    int arq;
+    int window;         //0 for the largest the scheme allows
+    int fcs;
+    int fecParity;
+    int fecDepth;
+    int maxPayload;
+    int framing;
+    int whitening;
+    int explicitMask;   //Bit per PARAMETER the user gave
+} Settings;
+__thread Settings localSettings;
+__thread int lineRate = 0;   //Baud rate read back from the port
+__thread int maxPayload = MAX_PAYLOAD_SIZE;
+#define NEGOTIATION_ATTEMPTS 3      //Extended SETs before falling back to the plain handshake
+__thread unsigned char peerParameters[MAX_ARRAY_SIZE];   //Block of the last extended UA
+__thread int peerParametersSize = 0;
+__thread unsigned char agreedBlock[MAX_ARRAY_SIZE];      //Settings the receiver agreed to, sent in its UA
+__thread int agreedSize = 0;
+
+//Sliding window (stop-and-wait is a window of 1 with modulo-2 numbers)
+__thread int arqMode = STOP_AND_WAIT;
+__thread int seqModulus = 2;
+__thread int windowSize = 1;
+__thread int sendBase = 0;       //Oldest unacknowledged frame
+__thread int nextSeq = 0;        //Next sequence number to send
+__thread int expectedSeq = 0;    //Receiver: next in-order sequence number
+__thread int rejectSent = FALSE; //Receiver: a REJ is pending for expectedSeq
+__thread unsigned char txFrames[EXTENDED_MODULUS][MAX_FRAME_SIZE];   //Copies kept for retransmission
+__thread int txFrameSizes[EXTENDED_MODULUS];
+__thread unsigned char txPayloads[EXTENDED_MODULUS][MAX_PAYLOAD_SIZE];  //Modulo 8: payloads to frame again with a fresh N(r)
+__thread int txPayloadSizes[EXTENDED_MODULUS];
+__thread long long txSentAt[EXTENDED_MODULUS];
+__thread int txTransmissions[EXTENDED_MODULUS];  //Karn's rule: only frames sent once give RTT samples
+
+//Selective repeat receiver: frames that arrived ahead of expectedSeq
+__thread unsigned char rxFrames[EXTENDED_MODULUS][MAX_PAYLOAD_SIZE];
+__thread int rxFrameSizes[EXTENDED_MODULUS];
+__thread int rxStored[EXTENDED_MODULUS];
+__thread int srejSent[EXTENDED_MODULUS];
+
+//In-order payloads waiting for llread(). Both ends may send I frames at any time, so frames
+//arrive while llwrite() waits too. They are destuffed straight into the free slot.
+#define READY_SLOTS EXTENDED_MODULUS
+__thread unsigned char readyFrames[READY_SLOTS][MAX_BODY_SIZE];
+__thread int readySizes[READY_SLOTS];
+__thread int readyHead = 0;
+__thread int readyCount = 0;
+__thread unsigned char spareFrame[MAX_BODY_SIZE];    //Receives frames while the queue is full
+__thread int ackPending = FALSE;     //RR owed to the peer, rides on our next I frame if one goes out first
+__thread int receivedAck = -1;       //N(r) piggybacked on the last I frame, -1 with modulo 2
+__thread int discReceived = FALSE;
 
 
 
@@ -44,9 +183,280 @@ unsigned char getBCC(const unsigned char *content, int size) {
     return result;
 }
 
-void alarmHandler(int signal)
-{
-    alarmEnabled = FALSE;
+unsigned char getDataBCC(const unsigned char *content, int size) {
+    unsigned char result = 0;
+    for (int i = 0; i < size; i++) {
+        result ^= content[i];
+    }
+    return result;
+}
+
+//Frame check sequence of I frames: BCC2 alone, or a CRC over address, control and payload as in HDLC
+__thread int fcsMode = FCS_BCC;
+__thread int fcsSize = 1;
+
+//Forward error correction: Reed-Solomon parity after the FCS, 0 parity bytes turns it off
+__thread int fecParity = 0;
+__thread int fecDepth = 1;
+
+//Framing of I frame bodies: byte stuffing, COBS, or a length field and the raw bytes.
+//The length field is two bytes, big-endian, followed by a CRC-8 over the header and the length.
+__thread int framingMode = FRAMING_STUFFING;
+#define LENGTH_FIELD_SIZE 3
+
+//Whitening: with stuffing, the payload is XORed with the mask that leaves the fewest bytes
+//to escape. The mask goes first in the body, so the FCS and FEC cover it.
+__thread int whitening = FALSE;
+
+unsigned int startFcs(const unsigned char *header) {
+    //header points at the address byte
+    if (fcsMode == FCS_CRC16) {
+        return crc16Update(CRC16_INIT, header, 2);
+    }
+    if (fcsMode == FCS_CRC32) {
+        return crc32Update(CRC32_INIT, header, 2);
+    }
+    return 0;
+}
+
+unsigned int updateFcs(unsigned int crc, const unsigned char *data, int size) {
+    if (fcsMode == FCS_CRC16) {
+        return crc16Update(crc, data, size);
+    }
+    if (fcsMode == FCS_CRC32) {
+        return crc32Update(crc, data, size);
+    }
+    return crc;
+}
+
+int writeFcs(unsigned char *fcs, unsigned int crc, unsigned char bcc) {
+    //Complemented CRC, low byte first. Returns the number of bytes.
+    if (fcsMode == FCS_BCC) {
+        fcs[0] = bcc;
+        return 1;
+    }
+    crc = ~crc;
+    for (int i = 0; i < fcsSize; i++) {
+        fcs[i] = (crc >> (8 * i)) & 0xff;
+    }
+    return fcsSize;
+}
+
+int fcsValid(unsigned int crc, unsigned char bcc) {
+    //crc and bcc ran over the payload and the received FCS
+    if (fcsMode == FCS_CRC16) {
+        return crc == CRC16_RESIDUE;
+    }
+    if (fcsMode == FCS_CRC32) {
+        return crc == CRC32_RESIDUE;
+    }
+    return bcc == 0;
+}
+
+long long nowUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void armTimerFd() {
+    long long earliest = 0;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timerDeadline[i] != 0 && (earliest == 0 || timerDeadline[i] < earliest)) {
+            earliest = timerDeadline[i];
+        }
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));     //All zero disarms
+    if (earliest != 0) {
+        spec.it_value.tv_sec = earliest / 1000000;
+        spec.it_value.tv_nsec = (earliest % 1000000) * 1000;
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void startTimer(int id, long long us) {
+    timerDeadline[id] = nowUs() + (us < 1 ? 1 : us);
+    armTimerFd();
+}
+
+void stopTimer(int id) {
+    if (timerDeadline[id] != 0) {
+        timerDeadline[id] = 0;
+        armTimerFd();
+    }
+}
+
+int nextExpiredTimer() {
+    //Returns the id of a timer whose deadline passed, or -1. The caller stops it.
+    long long now = nowUs();
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timerDeadline[i] != 0 && timerDeadline[i] <= now) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int fillRxRing() {
+    //One read() takes everything the port has, up to the free contiguous space
+    int start = rxRingTail & (RX_RING_SIZE - 1);
+    int space = RX_RING_SIZE - (rxRingTail - rxRingHead);
+    if (space > RX_RING_SIZE - start) {
+        space = RX_RING_SIZE - start;
+    }
+    int bytes = read(fd, rxRing + start, space);
+    stats.readCalls++;
+    if (bytes > 0) {
+        rxRingTail += bytes;
+        stats.bytesRead += bytes;
+    }
+    return bytes;
+}
+
+int waitForBytes() {
+    //Returns 1 once the ring holds data, 0 once a timer expired, -1 on error
+    //Buffered bytes are served from memory, timers are only checked when the ring runs dry
+    while (rxRingHead == rxRingTail) {
+        if (nextExpiredTimer() >= 0) {
+            return 0;
+        }
+        int bytes = fillRxRing();
+        if (bytes > 0) {
+            break;
+        }
+        if (bytes < 0) {
+            return -1;
+        }
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {timerFd, POLLIN, 0}};
+        stats.pollCalls++;
+        if (poll(fds, 2, -1) < 0) {
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            read(timerFd, &expirations, sizeof(expirations));
+        }
+    }
+    return 1;
+}
+
+int readByte(unsigned char *byte) {
+    //Same return values as waitForBytes()
+    int ready = waitForBytes();
+    if (ready != 1) {
+        return ready;
+    }
+    *byte = rxRing[rxRingHead & (RX_RING_SIZE - 1)];
+    rxRingHead++;
+    return 1;
+}
+
+void updateRto(long long sampleUs) {
+    //RFC 6298: SRTT += (R - SRTT) / 8, RTTVAR += (|SRTT - R| - RTTVAR) / 4, RTO = SRTT + 4 * RTTVAR
+    if (rttSamples == 0) {
+        srttUs = sampleUs;
+        rttvarUs = sampleUs / 2;
+    }
+    else {
+        long long delta = srttUs > sampleUs ? srttUs - sampleUs : sampleUs - srttUs;
+        rttvarUs = (3 * rttvarUs + delta) / 4;
+        srttUs = (7 * srttUs + sampleUs) / 8;
+    }
+    rttSamples++;
+    rtoUs = srttUs + 4 * rttvarUs;
+    if (rtoUs < rtoMinUs) {
+        rtoUs = rtoMinUs;
+    }
+    else if (rtoUs > rtoMaxUs) {
+        rtoUs = rtoMaxUs;
+    }
+}
+
+void backoffRto() {
+    //Timeouts double the RTO until a clean sample arrives again
+    stats.timeouts++;
+    rtoUs *= 2;
+    if (rtoUs > rtoMaxUs) {
+        rtoUs = rtoMaxUs;
+    }
+}
+
+//Sequence numbers in the control byte
+//Modulo 2 keeps the original encoding (INFO_0/INFO_1, RR_0/RR_1, REJ_0/REJ_1)
+//Modulo 8: I has N(s) in bits 1-3 and the piggybacked N(r) in bits 5-7, RR/REJ/SREJ have N(r) in bits 5-7
+int encodeControl(int type, int seq, unsigned char *control) {
+    if (seq < 0 || seq >= seqModulus) {
+        return -1;
+    }
+    if (seqModulus == 2) {
+        if (type == INFO) {
+            *control = seq == 0 ? CNTRL_INFO_0 : CNTRL_INFO_1;
+        }
+        else if (type == RR) {
+            *control = seq == 0 ? CNTRL_RR_0 : CNTRL_RR_1;
+        }
+        else if (type == REJ) {
+            *control = seq == 0 ? CNTRL_REJ_0 : CNTRL_REJ_1;
+        }
+        else {
+            return -1;
+        }
+        return 0;
+    }
+    if (type == INFO) {
+        *control = CNTRL_INFO_MOD8 | (seq << 1) | (expectedSeq << 5);
+    }
+    else if (type == RR) {
+        *control = CNTRL_RR_MOD8 | (seq << 5);
+    }
+    else if (type == REJ) {
+        *control = CNTRL_REJ_MOD8 | (seq << 5);
+    }
+    else if (type == SREJ) {
+        *control = CNTRL_SREJ_MOD8 | (seq << 5);
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+int decodeControl(unsigned char control, int *seq) {
+    if (seqModulus == 2) {
+        if (control == CNTRL_INFO_0 || control == CNTRL_INFO_1) {
+            *seq = control == CNTRL_INFO_1;
+            receivedAck = -1;
+            return INFO;
+        }
+        if (control == CNTRL_RR_0 || control == CNTRL_RR_1) {
+            *seq = control == CNTRL_RR_1;
+            return RR;
+        }
+        if (control == CNTRL_REJ_0 || control == CNTRL_REJ_1) {
+            *seq = control == CNTRL_REJ_1;
+            return REJ;
+        }
+        return INVALID;
+    }
+    if ((control & 0x11) == CNTRL_INFO_MOD8) {
+        *seq = (control >> 1) & 0x07;
+        receivedAck = control >> 5;
+        return INFO;
+    }
+    if ((control & 0x1f) == CNTRL_RR_MOD8) {
+        *seq = control >> 5;
+        return RR;
+    }
+    if ((control & 0x1f) == CNTRL_REJ_MOD8) {
+        *seq = control >> 5;
+        return REJ;
+    }
+    if ((control & 0x1f) == CNTRL_SREJ_MOD8) {
+        *seq = control >> 5;
+        return SREJ;
+    }
+    return INVALID;
 }
 
 int getHeaderType(unsigned char *header, int *responseParity) {
@@ -55,390 +465,1309 @@ int getHeaderType(unsigned char *header, int *responseParity) {
         return INVALID;
     }
     //2- Check address and control, fill parity
+    //Commands carry the sender's command address, responses the address of the command they answer
     *responseParity = -1; //Default value if not used
-    if (machine == TRANSMITTER) {   //Transmitter receiving: receiver sending
-        if (header[1] == A_TRANSMITTER_COMMAND) {  //Receiver Responses: RR, REJ and UA
-            if (header[2] == CNTRL_UA) {
-                return UA;
-            }
-            else if (header[2] == CNTRL_REJ_0) {
-                *responseParity = 0;
-                return REJ;
-            }
-            else if (header[2] == CNTRL_REJ_1) {
-                *responseParity = 1;
-                return REJ;
-            }
-            else if (header[2] == CNTRL_RR_0) {
-                *responseParity = 0;
-                return RR;
-            }
-            else if (header[2] == CNTRL_RR_1) {
-                *responseParity = 1;
-                return RR;
-            }
+    unsigned char ownCommand = machine == TRANSMITTER ? A_TRANSMITTER_COMMAND : A_RECEIVER_COMMAND;
+    unsigned char peerCommand = machine == TRANSMITTER ? A_RECEIVER_COMMAND : A_TRANSMITTER_COMMAND;
+    if (header[1] == peerCommand) {     //Peer commands: SET, I and DISC
+        if (decodeControl(header[2], responseParity) == INFO) {
+            return INFO;
         }
-        else if (header[1] == A_RECEIVER_COMMAND) { //Receiver Command: DISC
-            if (header[2] == CNTRL_DISC) {
-                return DISC;
-            }
+        else if (header[2] == CNTRL_SET) {
+            return SET;
+        }
+        else if (header[2] == CNTRL_DISC) {
+            return DISC;
         }
     }
-    else if (machine == RECEIVER) { //Receiver receiving: transmitter sending
-        if (header[1] == A_TRANSMITTER_COMMAND) {   //Transmitter Commands: SET, I and DISC
-            if (header[2] == CNTRL_INFO_0) {
-                *responseParity = 0;
-                return INFO;
-            }
-            else if (header[2] == CNTRL_INFO_1) {
-                *responseParity = 1;
-                return INFO;
-            }
-            else if (header[2] == CNTRL_SET) {
-                return SET;
-            }
-            else if (header[2] == CNTRL_DISC) {
-                return DISC;
-            }
+    else if (header[1] == ownCommand) { //Peer responses: UA, RR, REJ and SREJ
+        if (header[2] == CNTRL_UA) {
+            return UA;
         }
-        else if (header[1] == A_RECEIVER_COMMAND) { //Transmitter response: UA
-            if (header[2] == CNTRL_UA) {
-                return UA;
-            }
+        int type = decodeControl(header[2], responseParity);
+        if (type == RR || type == REJ || type == SREJ) {
+            return type;
         }
     }
     return INVALID;
 }
 
-int createHeader(unsigned char *header, int type, int messageParity) {
+int createHeader(unsigned char *header, int type, int seq) {
+    //Either end sends commands (SET, INFO, DISC) and responses (UA, RR, REJ, SREJ)
     header[0] = FLAG;
-    if (machine == TRANSMITTER) {
-        if (type == UA) {
-            header[1] = A_RECEIVER_COMMAND;
-            header[2] = CNTRL_UA;           //Transmitter Response, only UA
+    unsigned char ownCommand = machine == TRANSMITTER ? A_TRANSMITTER_COMMAND : A_RECEIVER_COMMAND;
+    unsigned char peerCommand = machine == TRANSMITTER ? A_RECEIVER_COMMAND : A_TRANSMITTER_COMMAND;
+    if (type == SET || type == DISC || type == INFO) {
+        header[1] = ownCommand;
+    }
+    else {
+        header[1] = peerCommand;
+    }
+    if (type == SET) {
+        header[2] = CNTRL_SET;
+    }
+    else if (type == DISC) {
+        header[2] = CNTRL_DISC;
+    }
+    else if (type == UA) {
+        header[2] = CNTRL_UA;
+    }
+    else if (type == INFO || type == RR || type == REJ || type == SREJ) {
+        if (encodeControl(type, seq, &header[2]) != 0) {
+            return -1;
         }
-        else {
-            header[1] = A_TRANSMITTER_COMMAND;  //Transmitter Command: SET, INFO and DISC
-            if (type == SET) {
-                header[2] = CNTRL_SET;
-            }
-            else if (type == INFO) {
-                if (messageParity == 0) {
-                    header[2] = CNTRL_INFO_0;
-                }
-                else if (messageParity == 1) {
-                    header[2] = CNTRL_INFO_1;
+    }
+    else {
+        return -1;
+    }
+    header[3] = getBCC(header, 3);
+    if (type != INFO) {
+        header[4] = FLAG;
+    }
+    return 0;
+}
+
+//Debug Functions
+void printByte(unsigned char byte) {
+    printf("%hhx\n", byte);
+}
+void printByteSequence(unsigned char *sequence, int size) {
+    for (size_t i = 0; i < size-1; i++) {
+        printf("%hhx-", sequence[i]);
+    }
+    printf("%hhx\n", sequence[size-1]);
+}
+
+//----------------TESTED AND VALIDATED UNTIL HERE---------------
+
+int checkInfoBody(unsigned char *data, int counter, unsigned int crc, unsigned char check, const unsigned char *address, int *size) {
+    //Repairs and checks a complete body, same return values as receiveInfoBody()
+    stats.framesParsed++;
+    if (fecParity > 0) {    //Repair first, the FCS then checks the repaired bytes
+        counter -= fecParity * fecDepth;
+        if (counter < 0 || (counter + fecDepth - 1) / fecDepth + fecParity > 255) {
+            return INFO_ERROR;  //Longer than any frame we agreed to, merged or damaged
+        }
+        int corrected = fecDecode(data, counter, fecParity, fecDepth);
+        if (corrected < 0) {
+            return INFO_ERROR;
+        }
+        stats.fecCorrected += corrected;
+        crc = updateFcs(startFcs(address), data, counter);
+        check = getDataBCC(data, counter);
+    }
+    if (counter < fcsSize || !fcsValid(crc, check)) {
+        return INFO_ERROR;
+    }
+    counter -= fcsSize;
+    if (whitening) {
+        if (counter < MASK_SIZE) {
+            return INFO_ERROR;
+        }
+        counter -= MASK_SIZE;
+        applyMask(data, data + MASK_SIZE, counter, data[0]);
+    }
+    if (size != NULL) {
+        *size = counter;
+    }
+    return INFO;
+}
+
+int receiveLengthBody(unsigned char *data, int *size) {
+    //Length framing: the field says how many raw bytes follow, flags inside them mean nothing.
+    //A damaged field cannot be trusted to find the end, so the frame is dropped and the
+    //caller resynchronises on the next flag.
+    unsigned char header[5] = {data[1], data[2], data[3]};
+    for (int i = 3; i <= 5; i++) {
+        int ready = waitForBytes();
+        if (ready <= 0) {
+            return ready == 0 ? TIMEOUT : INVALID;
+        }
+        unsigned char byte = rxRing[rxRingHead & (RX_RING_SIZE - 1)];
+        if (i == 5 && crc8Update(0, header, 5) != byte) {
+            return INFO_ERROR;      //Left in the ring, it may be the flag of the next frame
+        }
+        if (i < 5) {
+            header[i] = byte;
+        }
+        rxRingHead++;
+    }
+    int length = header[3] << 8 | header[4];
+    if (length > MAX_BODY_SIZE) {
+        return INFO_ERROR;
+    }
+    int counter = 0;
+    while (counter < length) {
+        int ready = waitForBytes();
+        if (ready <= 0) {
+            return ready == 0 ? TIMEOUT : INVALID;
+        }
+        int start = rxRingHead & (RX_RING_SIZE - 1);
+        int span = (int) (rxRingTail - rxRingHead);
+        if (span > RX_RING_SIZE - start) {
+            span = RX_RING_SIZE - start;
+        }
+        if (span > length - counter) {
+            span = length - counter;
+        }
+        memcpy(data + counter, rxRing + start, span);
+        rxRingHead += span;
+        counter += span;
+    }
+    int ready = waitForBytes();
+    if (ready <= 0) {
+        return ready == 0 ? TIMEOUT : INVALID;
+    }
+    if (rxRing[rxRingHead & (RX_RING_SIZE - 1)] != FLAG) {
+        return INFO_ERROR;
+    }
+    rxRingHead++;
+    unsigned int crc = fecParity == 0 ? updateFcs(startFcs(header), data, counter) : 0;
+    return checkInfoBody(data, counter, crc, getDataBCC(data, counter), header, size);
+}
+
+int receiveInfoBody(unsigned char *data, int *size) {
+    //Decodes the body of an I frame straight from the ring into data, one contiguous span at a time,
+    //and keeps BCC2 running so the frame is checked as soon as its closing flag arrives.
+    //Returns INFO, INFO_ERROR for a damaged frame, INVALID for a runaway one, or TIMEOUT.
+    if (framingMode == FRAMING_LENGTH) {
+        return receiveLengthBody(data, size);
+    }
+    int counter = 0;
+    int wire = 0;
+    int escapePending = FALSE;
+    CobsDecoder decoder;
+    int broken = FALSE;
+    unsigned char check = 0;
+    unsigned char address[2] = {data[1], data[2]};
+    unsigned int crc = startFcs(address);
+    cobsStart(&decoder);
+    while (1) {
+        int ready = waitForBytes();
+        if (ready == 0) {
+            return TIMEOUT;
+        }
+        if (ready < 0) {
+            return INVALID;
+        }
+        int start = rxRingHead & (RX_RING_SIZE - 1);
+        int span = (int) (rxRingTail - rxRingHead);
+        if (span > RX_RING_SIZE - start) {
+            span = RX_RING_SIZE - start;
+        }
+        unsigned char *end = memchr(rxRing + start, FLAG, span);
+        int chunk = end != NULL ? (int) (end - (rxRing + start)) : span;
+        wire += chunk;
+        if (wire > MAX_FRAME_SIZE) {
+            rxRingHead += chunk;
+            return INVALID;     //Runaway frame, lost its closing flag
+        }
+        if (!broken) {
+            //Decoding never grows the data, so bounding the input keeps it inside data
+            int limit = MAX_BODY_SIZE - counter;
+            if (chunk > limit) {
+                if (limit == 0) {
+                    rxRingHead += chunk;
+                    return INVALID;
                 }
-                else {
-                    return -1;
+                wire -= chunk - limit;
+                chunk = limit;
+                end = NULL;
+            }
+            int written;
+            if (framingMode == FRAMING_COBS) {
+                written = cobsDecodeChunk(data + counter, rxRing + start, chunk, &decoder);
+                if (written > 0) {
+                    check ^= getDataBCC(data + counter, written);
                 }
             }
-            else if (type == DISC) {
-                header[2] = CNTRL_DISC;
+            else {
+                written = destuffChunk(data + counter, rxRing + start, chunk, &escapePending, &check);
+            }
+            if (written < 0) {
+                broken = TRUE;      //Broken escape sequence, skip to the closing flag
             }
             else {
-                return -1;
+                if (fecParity == 0) {
+                    crc = updateFcs(crc, data + counter, written);
+                }
+                counter += written;
             }
         }
-
+        rxRingHead += chunk;
+        if (end != NULL) {
+            rxRingHead++;   //Closing flag
+            if (broken || escapePending || (framingMode == FRAMING_COBS && !cobsComplete(&decoder))) {
+                stats.framesParsed++;
+                return INFO_ERROR;
+            }
+            return checkInfoBody(data, counter, crc, check, address, size);
+        }
     }
-    else if (machine == RECEIVER) {
-        if (type == DISC) {
-            header[1] = A_RECEIVER_COMMAND;
-            header[2] = CNTRL_DISC;           //Receiver Command, only DISC
+}
+
+int receivePacket(unsigned char *data, int *size, int *parityReceived) {
+    //Internal State Machine
+    enum STATE_MACHINE {WAIT_FOR_FLAG = 0, BUILDING_HEADER, WAIT_FOR_LAST_FLAG, FILLING_PARAMETERS, OVER};
+    unsigned char byteReceived;
+    int bytes = -1;
+    int counter = 0;
+    int state = WAIT_FOR_FLAG;
+    int header = INVALID;
+
+    while(state != OVER){
+        bytes = readByte(&byteReceived);
+        if (bytes == 0) {
+            return TIMEOUT;     //Caller handles the expired timer, a partial frame is dropped
         }
-        else {
-            header[1] = A_TRANSMITTER_COMMAND; //Receiver Response: UA, RR and REJ
-            if (type == UA) {
-                header[2] = CNTRL_UA;
-            }
-            else if (type == RR) {
-                if (messageParity == 0) {
-                    header[2] = CNTRL_RR_0;
+        if (bytes < 0) {
+            return INVALID;
+        }
+        switch (state) {
+            case WAIT_FOR_FLAG:
+                if (bytes == 1 && byteReceived == FLAG) {
+                    data[0] = FLAG;
+                    state = BUILDING_HEADER;
                 }
-                else if (messageParity == 1) {
-                    header[2] = CNTRL_RR_1;
+                break;
+            case BUILDING_HEADER:
+                if (bytes == 1) {
+                    if (byteReceived == FLAG) {
+                        counter = 0;
+                    }
+                    else {
+                        counter++;
+                        data[counter] = byteReceived;
+                    }
                 }
-                else {
-                    return -1;
+                if (counter == 3) {
+                    header = getHeaderType(data, parityReceived);
+                    if (header == INVALID) {
+                        state = WAIT_FOR_FLAG;
+                        counter = 0;
+                    }
+                    else if (header == INFO) {
+                        header = receiveInfoBody(data, size);
+                        if (header != INVALID) {
+                            return header;  //A damaged frame still reports its sequence number
+                        }
+                        state = WAIT_FOR_FLAG;
+                        counter = 0;
+                    }
+                    else {
+                        state = WAIT_FOR_LAST_FLAG;
+                    }
                 }
-            }
-            else if (type == REJ) {
-                if (messageParity == 0) {
-                    header[2] = CNTRL_REJ_0;
+                break;
+            case WAIT_FOR_LAST_FLAG:
+                if (bytes == 1 && byteReceived == FLAG) {
+                    state = OVER;
+                    stats.framesParsed++;
+                    if (size != NULL) {
+                        *size = 0;
+                    }
                 }
-                else if (messageParity == 1) {
-                    header[2] = CNTRL_REJ_1;
+                else if (bytes == 1 && (header == SET || header == UA)) {  //Extended handshake: parameters follow
+                    data[0] = byteReceived;
+                    counter = 1;
+                    state = FILLING_PARAMETERS;
                 }
-                else {
-                    return -1;
+                else if (bytes == 1) {
+                    state = WAIT_FOR_FLAG;
+                    counter = 0;
                 }
+                break;
+            case FILLING_PARAMETERS:
+                if (bytes == 1 && byteReceived == FLAG) {
+                    counter = destuffBytes(data, counter);
+                    if (counter < 1 || getDataBCC(data, counter) != 0) {    //Always BCC2, nothing is agreed yet
+                        state = WAIT_FOR_FLAG;
+                        counter = 0;
+                        break;
+                    }
+                    state = OVER;
+                    stats.framesParsed++;
+                    if (size != NULL) {
+                        *size = counter - 1;
+                    }
+                }
+                else if (bytes == 1 && counter >= 2 * (MAX_ARRAY_SIZE + 1)) {
+                    state = WAIT_FOR_FLAG;
+                    counter = 0;
+                }
+                else if (bytes == 1) {
+                    data[counter++] = byteReceived;
+                }
+                break;
+        }
+    }
+    return header;
+}
+
+int sendSupervision(int type, int seq) {
+    unsigned char header[5];
+    if (createHeader(header, type, seq) != 0) {
+        return -1;
+    }
+    if (write(fd, header, 5) != 5) {
+        return -1;
+    }
+    return 0;
+}
+
+int buildInfoFrame(unsigned char *frame, int seq, const unsigned char *prefix, int prefixSize, const unsigned char *data, int dataSize) {
+    //Returns the size of the frame, header included. The payload is prefix followed by data.
+    //One pass stuffs the caller's buffers straight into the frame and computes BCC2 on the way
+    if (createHeader(frame, INFO, seq) != 0) {
+        return -1;
+    }
+    unsigned char bcc;
+    unsigned char dataBcc;
+    unsigned char fcs[MAX_FCS_SIZE];
+    int size;
+    if (framingMode == FRAMING_STUFFING && fecParity == 0 && !whitening) {
+        size = 4 + stuffBytes(frame + 4, prefix, prefixSize, &bcc);
+        size += stuffBytes(frame + size, data, dataSize, &dataBcc);
+        unsigned int crc = updateFcs(updateFcs(startFcs(frame + 1), prefix, prefixSize), data, dataSize);
+        int fcsBytes = writeFcs(fcs, crc, bcc ^ dataBcc);
+        size += stuffBytes(frame + size, fcs, fcsBytes, &bcc);
+        stats.bodyBytes += prefixSize + dataSize + fcsBytes;
+        stats.framedBytes += size - 4;
+        frame[size] = FLAG;
+        return size + 1;
+    }
+    //The body is laid out plain first: parity covers mask, payload and FCS, and the other
+    //framings encode it whole. Without stuffing it goes right after the length field.
+    unsigned char joined[MAX_PAYLOAD_SIZE];
+    if (prefixSize > 0) {
+        if (prefixSize + dataSize > MAX_PAYLOAD_SIZE) {
+            return -1;
+        }
+        memcpy(joined, prefix, prefixSize);
+        memcpy(joined + prefixSize, data, dataSize);
+        data = joined;
+        dataSize += prefixSize;
+    }
+    unsigned char scratch[MAX_BODY_SIZE];
+    unsigned char *body = framingMode == FRAMING_LENGTH ? frame + 4 + LENGTH_FIELD_SIZE : scratch;
+    int bodySize = dataSize;
+    if (whitening) {
+        body[0] = chooseMask(data, dataSize, FLAG, ESCAPE);
+        applyMask(body + MASK_SIZE, data, dataSize, body[0]);
+        bodySize += MASK_SIZE;
+        if (body[0] != 0) {
+            stats.framesMasked++;
+        }
+    }
+    else {
+        memcpy(body, data, dataSize);
+    }
+    bodySize += writeFcs(body + bodySize, updateFcs(startFcs(frame + 1), body, bodySize), getDataBCC(body, bodySize));
+    if (fecParity > 0) {
+        bodySize += fecEncode(body + bodySize, body, bodySize, fecParity, fecDepth);
+    }
+    if (framingMode == FRAMING_COBS) {
+        size = 4 + cobsEncode(frame + 4, body, bodySize);
+    }
+    else if (framingMode == FRAMING_LENGTH) {
+        frame[4] = bodySize >> 8;
+        frame[5] = bodySize & 0xff;
+        frame[6] = crc8Update(0, frame + 1, 5);     //A, C, BCC1 and the length
+        size = 4 + LENGTH_FIELD_SIZE + bodySize;
+    }
+    else {
+        size = 4 + stuffBytes(frame + 4, body, bodySize, &bcc);
+    }
+    stats.bodyBytes += bodySize;
+    stats.framedBytes += size - 4;
+    frame[size] = FLAG;
+    return size + 1;
+}
+
+////////////////////////////////////////////////
+// SLIDING WINDOW
+////////////////////////////////////////////////
+int outstandingFrames() {
+    return (nextSeq - sendBase + seqModulus) % seqModulus;
+}
+
+int withinWindow(int seq, int last) {
+    //seq lies in sendBase..last, modulo the sequence space
+    if (seq < 0 || seq >= seqModulus) {
+        return FALSE;
+    }
+    return (seq - sendBase + seqModulus) % seqModulus <= (last - sendBase + seqModulus) % seqModulus;
+}
+
+int refreshFrame(int seq) {
+    //A stored modulo-8 frame carries the N(r) of when it was built. It is framed again with the
+    //current one before each send, as an old N(r) can wrap into a valid-looking acknowledgement.
+    //The overhead statistics count each frame once.
+    if (seqModulus != EXTENDED_MODULUS || ((txFrames[seq][2] >> 5) & 0x07) == expectedSeq) {
+        return 0;
+    }
+    long long bodyBytes = stats.bodyBytes;
+    long long framedBytes = stats.framedBytes;
+    int framesMasked = stats.framesMasked;
+    int size = buildInfoFrame(txFrames[seq], seq, NULL, 0, txPayloads[seq], txPayloadSizes[seq]);
+    stats.bodyBytes = bodyBytes;
+    stats.framedBytes = framedBytes;
+    stats.framesMasked = framesMasked;
+    if (size < 0) {
+        return -1;
+    }
+    txFrameSizes[seq] = size;
+    return 0;
+}
+
+int transmitFrame(int seq) {
+    if (refreshFrame(seq) != 0) {
+        return -1;
+    }
+    if (write(fd, txFrames[seq], txFrameSizes[seq]) != txFrameSizes[seq]) {
+        return -1;
+    }
+    txSentAt[seq] = nowUs();
+    txTransmissions[seq]++;
+    if (txTransmissions[seq] > 1) {
+        stats.retransmissions++;
+    }
+    if (arqMode == SELECTIVE_REPEAT) {
+        startTimer(seq, rtoUs);     //Each frame has its own deadline
+    }
+    return 0;
+}
+
+int retransmitFrom(int seq) {
+    for (int i = seq; i != nextSeq; i = (i + 1) % seqModulus) {
+        if (transmitFrame(i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LINK SUPERVISION
+////////////////////////////////////////////////
+void restartTimers() {
+    //The frames in flight get their retransmission timers back, at the current RTO
+    if (outstandingFrames() == 0) {
+        return;
+    }
+    if (arqMode == SELECTIVE_REPEAT) {
+        for (int i = sendBase; i != nextSeq; i = (i + 1) % seqModulus) {
+            startTimer(i, rtoUs);
+        }
+    }
+    else {
+        startTimer(WINDOW_TIMER, rtoUs);
+    }
+}
+
+int noteTimeout(int oldest) {
+    //Called for each expired retransmission timer. Only the timer of the oldest frame counts towards
+    //the limit, selective repeat frames sent together would otherwise expire together.
+    //Returns TRUE while the link is down, so the caller probes instead of retransmitting.
+    if (linkLost) {
+        probeUs = 2 * probeUs > probeMaxUs ? probeMaxUs : 2 * probeUs;
+        return TRUE;
+    }
+    backoffRto();
+    if (!oldest || ++consecutiveTimeouts < maxTimeouts) {
+        return FALSE;
+    }
+    linkLost = TRUE;
+    stats.outages++;
+    probeUs = rtoUs < probeMaxUs ? rtoUs : probeMaxUs;
+    for (int i = 0; i <= WINDOW_TIMER; i++) {   //Only the probe timer runs while the link is down
+        timerDeadline[i] = 0;
+    }
+    armTimerFd();
+    printf("Link down: %d timeouts without an answer, probing\n", consecutiveTimeouts);
+    return TRUE;
+}
+
+int sendProbe() {
+    //The oldest frame in flight goes out alone. Whatever is still queued for the line is dropped
+    //first: it would only reach the peer after the link is back, ahead of anything useful.
+    if (outstandingFrames() == 0) {
+        return 0;
+    }
+    tcflush(fd, TCOFLUSH);
+    if (refreshFrame(sendBase) != 0) {
+        return -1;
+    }
+    if (write(fd, txFrames[sendBase], txFrameSizes[sendBase]) != txFrameSizes[sendBase]) {
+        return -1;
+    }
+    txTransmissions[sendBase]++;
+    stats.retransmissions++;
+    stats.probes++;
+    startTimer(PROBE_TIMER, probeUs);
+    return 0;
+}
+
+void peerHeard() {
+    //Any valid frame shows the line works. After an outage the RTO goes back to the estimate from
+    //before it and the window resumes where it stopped, nothing is renegotiated.
+    long long now = nowUs();
+    consecutiveTimeouts = 0;
+    if (linkLost) {
+        linkLost = FALSE;
+        stopTimer(PROBE_TIMER);
+        stats.downUs += now - lastHeardUs;
+        if (rttSamples > 0) {
+            rtoUs = srttUs + 4 * rttvarUs;
+            rtoUs = rtoUs < rtoMinUs ? rtoMinUs : rtoUs > rtoMaxUs ? rtoMaxUs : rtoUs;
+        }
+        else {
+            rtoUs = initialRtoUs;
+        }
+        restartTimers();
+        stalledFrames = outstandingFrames();
+        restoredUs = stalledFrames > 0 ? now : 0;
+        printf("Link up after %.3f s, probing every %.0f ms at the end\n", (now - lastHeardUs) / 1000000.0, probeUs / 1000.0);
+    }
+    lastHeardUs = now;
+}
+
+void noteProgress(int acknowledged) {
+    //Recovery ends once every frame that was in flight during the outage is confirmed
+    if (restoredUs == 0) {
+        return;
+    }
+    stalledFrames -= acknowledged;
+    if (stalledFrames <= 0) {
+        stats.recoveryUs += nowUs() - restoredUs;
+        restoredUs = 0;
+    }
+}
+
+int bytesAvailable() {
+    int available = 0;
+    if (ioctl(fd, FIONREAD, &available) != 0) {
+        available = 0;
+    }
+    return available + (int) (rxRingTail - rxRingHead);
+}
+
+int handleAcknowledge(int type, int seq) {
+    //RR(N) and REJ(N) both confirm every frame before N, SREJ(N) only asks for N again
+    if (type == SREJ) {
+        stats.rejReceived++;
+        if (outstandingFrames() > 0 && withinWindow(seq, (nextSeq - 1 + seqModulus) % seqModulus)) {
+            if (transmitFrame(seq) != 0) {
+                return -1;
             }
-            else {
+        }
+        return 0;
+    }
+    if (!withinWindow(seq, nextSeq)) {
+        return 0;   //Outside sendBase..nextSeq, stale
+    }
+    int acknowledged = (seq - sendBase + seqModulus) % seqModulus;
+    if (type == REJ) {
+        stats.rejReceived++;
+    }
+    if (acknowledged > 0) {
+        int newest = (seq - 1 + seqModulus) % seqModulus;
+        if (txTransmissions[newest] == 1) {
+            updateRto(nowUs() - txSentAt[newest]);
+        }
+        noteProgress(acknowledged);
+    }
+    if (arqMode == SELECTIVE_REPEAT) {
+        for (int i = sendBase; i != seq; i = (i + 1) % seqModulus) {
+            stopTimer(i);
+        }
+        sendBase = seq;
+        return 0;
+    }
+    sendBase = seq;
+    if (type == REJ && outstandingFrames() > 0) {
+        if (retransmitFrom(sendBase) != 0) {
+            return -1;
+        }
+        startTimer(WINDOW_TIMER, rtoUs);
+    }
+    else if (acknowledged > 0) {
+        if (outstandingFrames() > 0) {
+            startTimer(WINDOW_TIMER, rtoUs);
+        }
+        else {
+            stopTimer(WINDOW_TIMER);
+        }
+    }
+    return 0;
+}
+
+int handleTimeout(int id) {
+    stopTimer(id);
+    if (noteTimeout(id >= WINDOW_TIMER || id == sendBase)) {    //Down: a single probe instead of the retransmissions
+        return sendProbe();
+    }
+    if (id == WINDOW_TIMER) {       //Oldest frame expired: go back N
+        if (retransmitFrom(sendBase) != 0) {
+            return -1;
+        }
+        startTimer(WINDOW_TIMER, rtoUs);
+    }
+    else if (id < EXTENDED_MODULUS) {   //Selective repeat: only this frame is sent again
+        if (transmitFrame(id) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned char *readySlot() {
+    //Where the next frame is received: the free queue slot, or the spare buffer when the queue is full
+    if (readyCount == READY_SLOTS) {
+        return spareFrame;
+    }
+    return readyFrames[(readyHead + readyCount) % READY_SLOTS];
+}
+
+void queueReady(const unsigned char *data, int size) {
+    //Accepts the frame numbered expectedSeq, data may already be the free slot
+    int slot = (readyHead + readyCount) % READY_SLOTS;
+    if (data != readyFrames[slot]) {
+        memcpy(readyFrames[slot], data, size);
+    }
+    readySizes[slot] = size;
+    readyCount++;
+    rxStored[expectedSeq] = FALSE;
+    srejSent[expectedSeq] = FALSE;
+    expectedSeq = (expectedSeq + 1) % seqModulus;
+    rejectSent = FALSE;
+    stats.framesReceived++;
+    ackPending = TRUE;
+}
+
+void drainStored() {
+    //Selective repeat: frames buffered ahead of a gap follow once it is filled
+    while (readyCount < READY_SLOTS && rxStored[expectedSeq]) {
+        queueReady(rxFrames[expectedSeq], rxFrameSizes[expectedSeq]);
+    }
+}
+
+int acknowledgeReceived() {
+    //RR for the frames just accepted. While our own frames are in flight the next one carries
+    //N(r) instead, and serviceLink() still sends the RR before it blocks.
+    if (!ackPending || (seqModulus == EXTENDED_MODULUS && outstandingFrames() > 0)) {
+        return 0;
+    }
+    ackPending = FALSE;
+    return sendSupervision(RR, expectedSeq);
+}
+
+int handleInfo(const unsigned char *frame, int msgSize, int seq) {
+    int distance = (seq - expectedSeq + seqModulus) % seqModulus;
+    if (distance >= windowSize) {   //Duplicate of a delivered frame, our RR was lost
+        stats.duplicatesReceived++;
+        ackPending = FALSE;
+        return sendSupervision(RR, expectedSeq);
+    }
+    if (msgSize > MAX_PAYLOAD_SIZE) {
+        return 0;
+    }
+    if (distance == 0) {
+        if (readyCount == READY_SLOTS) {
+            return 0;   //llread() is behind, the frame will be sent again
+        }
+        queueReady(frame, msgSize);
+        drainStored();
+        return acknowledgeReceived();
+    }
+    if (arqMode != SELECTIVE_REPEAT) {  //Ahead of expectedSeq: a frame was lost
+        if (!rejectSent) {
+            rejectSent = TRUE;
+            stats.rejSent++;
+            return sendSupervision(REJ, expectedSeq);
+        }
+        return 0;
+    }
+    if (!rxStored[seq]) {
+        memcpy(rxFrames[seq], frame, msgSize);
+        rxFrameSizes[seq] = msgSize;
+        rxStored[seq] = TRUE;
+    }
+    for (int i = expectedSeq; i != seq; i = (i + 1) % seqModulus) {   //Ask once for each gap
+        if (!rxStored[i] && !srejSent[i]) {
+            srejSent[i] = TRUE;
+            stats.rejSent++;
+            if (sendSupervision(SREJ, i) != 0) {
                 return -1;
             }
         }
     }
-    header[3] = getBCC(header, 3);
-    if (type != INFO) {
-        header[4] = FLAG;
+    return 0;
+}
+
+int handleDamaged(int seq) {
+    //The body failed its check but BCC1 vouched for the header: ask for the frame now
+    int distance = (seq - expectedSeq + seqModulus) % seqModulus;
+    if (arqMode == SELECTIVE_REPEAT) {
+        if (distance < windowSize && !rxStored[seq] && !srejSent[seq]) {
+            srejSent[seq] = TRUE;
+            stats.rejSent++;
+            return sendSupervision(SREJ, seq);
+        }
+    }
+    else if (distance == 0 && !rejectSent) {
+        rejectSent = TRUE;
+        stats.rejSent++;
+        return sendSupervision(REJ, expectedSeq);
     }
     return 0;
 }
 
-int addStuffing(unsigned char *content, int size) {  //Content should be WAY BIGGER than size
-    //content includes final flag
-    int newSize = 1;
-    for (size_t i = 0; i < size - 1; i++) { //For loop excludes last byte
-        if ( (content[i] == FLAG || content[i] == ESCAPE)) {
-            newSize++;
-        }
-        newSize++;
-    }                       //Checks size
-    unsigned char result[newSize];
-    size_t t = 0;
-    for (size_t i = 0; i < size - 1; i++){  //For loop excludes last byte
-        if (content[i] == FLAG) {
-            result[t] = ESCAPE;
-            result[t+1] = ESC_FLAG;
-            t += 2;
-        }
-        else if (content[i] == ESCAPE) {
-            result[t] = ESCAPE;
-            result[t+1] = ESC_ESCAPE;
-            t += 2;
-        }
-        else {
-            result[t] = content[i];
-            t++;
-        }
+int timerExpired(int id) {
+    return timerDeadline[id] != 0 && timerDeadline[id] <= nowUs();
+}
+
+int sendUnnumbered(int type, const unsigned char *parameters, int size) {
+    //SET and UA may carry a parameter block, stuffed and closed by its BCC2
+    unsigned char frame[2 * (MAX_ARRAY_SIZE + 1) + 5];
+    if (createHeader(frame, type, 0) != 0) {
+        return -1;
     }
-    result[newSize-1] = FLAG;
+    int frameSize = 5;
+    if ((type == SET || type == UA) && size > 0 && size <= MAX_ARRAY_SIZE) {
+        unsigned char bcc;
+        frameSize = 4 + stuffBytes(frame + 4, parameters, size, &bcc);
+        frameSize += stuffBytes(frame + frameSize, &bcc, 1, &bcc);
+        frame[frameSize++] = FLAG;
+    }
+    if (write(fd, frame, frameSize) != frameSize) {
+        return -1;
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < newSize; i++) {
-        content[i] = result[i];     //Copy memory
+int readOption(const char *name, int defaultValue) {
+    const char *value = getenv(name);
+    if (value == NULL || value[0] == '\0') {
+        return defaultValue;
     }
+    return atoi(value);
+}
 
-    return newSize;
+int optionSet(const char *name) {
+    const char *value = getenv(name);
+    return value != NULL && value[0] != '\0';
 }
 
-int removeStuffing(unsigned char *content, int size) {
-    int newSize = 1;
-    for (size_t i = 0; i < size - 1; i++){
-        if ( (content[i] == ESCAPE && content[i+1] == ESC_FLAG) || (content[i] == ESCAPE && content[i+1] == ESC_ESCAPE) ) {
-            newSize--;
-        }
-        newSize++;
-    }                       //Checks size
-    unsigned char result[newSize];
-    size_t t = 0;
-    for (size_t i = 0; i < size; i++){
-        if (content[i] == ESCAPE && content[i+1] == ESC_FLAG) {
-            result[t] = FLAG;
-            i++;
+void readSettings(Settings *settings) {
+    //Optional settings, read from the environment so both ends can be tuned without recompiling
+    memset(settings, 0, sizeof(*settings));
+    const char *mode = getenv("LL_ARQ");
+    settings->arq = STOP_AND_WAIT;
+    if (mode != NULL && strcmp(mode, "gbn") == 0) {
+        settings->arq = GO_BACK_N;
+    }
+    else if (mode != NULL && strcmp(mode, "sr") == 0) {
+        settings->arq = SELECTIVE_REPEAT;
+    }
+    settings->window = readOption("LL_WINDOW", 0);
+    mode = getenv("LL_FCS");
+    settings->fcs = FCS_BCC;
+    if (mode != NULL && strcmp(mode, "crc16") == 0) {
+        settings->fcs = FCS_CRC16;
+    }
+    else if (mode != NULL && strcmp(mode, "crc32") == 0) {
+        settings->fcs = FCS_CRC32;
+    }
+    settings->fecParity = readOption("LL_FEC", 0);
+    settings->fecDepth = readOption("LL_FEC_DEPTH", 1);
+    settings->maxPayload = MAX_PAYLOAD_SIZE;
+    mode = getenv("LL_FRAMING");
+    settings->framing = FRAMING_STUFFING;
+    if (mode != NULL && strcmp(mode, "cobs") == 0) {
+        settings->framing = FRAMING_COBS;
+    }
+    else if (mode != NULL && strcmp(mode, "length") == 0) {
+        settings->framing = FRAMING_LENGTH;
+    }
+    settings->whitening = readOption("LL_WHITEN", 0) != 0;
+    const char *names[] = {"LL_ARQ", "LL_WINDOW", "LL_FCS", "LL_FEC", "LL_FEC_DEPTH", NULL, "LL_FRAMING", "LL_WHITEN"};
+    for (int type = PARAM_ARQ; type <= PARAM_WHITENING; type++) {
+        if (names[type - PARAM_ARQ] != NULL && optionSet(names[type - PARAM_ARQ])) {
+            settings->explicitMask |= 1 << type;
         }
-        else if (content[i] == ESCAPE && content[i+1] == ESC_ESCAPE) {
-            result[t] = ESCAPE;
-            i++;
+    }
+}
+
+void configureWindow(int mode, int window) {
+    //Go-Back-N takes a window of 1 to 7, Selective Repeat 1 to 4, 0 picks the largest
+    arqMode = mode;
+    seqModulus = 2;
+    windowSize = 1;
+    int maxWindow = 1;
+    if (arqMode == GO_BACK_N) {
+        maxWindow = EXTENDED_MODULUS - 1;
+    }
+    else if (arqMode == SELECTIVE_REPEAT) {
+        maxWindow = EXTENDED_MODULUS / 2;   //Larger windows make old and new frames ambiguous
+    }
+    else {
+        arqMode = STOP_AND_WAIT;
+    }
+    if (arqMode != STOP_AND_WAIT) {
+        seqModulus = EXTENDED_MODULUS;
+        windowSize = window == 0 ? maxWindow : window;
+        if (windowSize < 1) {
+            windowSize = 1;
         }
-        else {
-            result[t] = content[i];
+        else if (windowSize > maxWindow) {
+            windowSize = maxWindow;
         }
-        t++;
     }
+    sendBase = 0;
+    nextSeq = 0;
+    expectedSeq = 0;
+    rejectSent = FALSE;
+    memset(rxStored, 0, sizeof(rxStored));
+    memset(srejSent, 0, sizeof(srejSent));
+    readyHead = 0;
+    readyCount = 0;
+    ackPending = FALSE;
+    discReceived = FALSE;
+}
 
-    for (size_t i = 0; i < newSize; i++){
-        content[i] = result[i];
+void configureFcs(int mode) {
+    //A CRC replaces BCC2, the header keeps BCC1
+    fcsMode = FCS_BCC;
+    fcsSize = 1;
+    if (mode == FCS_CRC16) {
+        fcsMode = FCS_CRC16;
+        fcsSize = 2;
+    }
+    else if (mode == FCS_CRC32) {
+        fcsMode = FCS_CRC32;
+        fcsSize = 4;
     }
+}
 
-    return newSize;
+void configureFec(int parity, int depth) {
+    //parity Reed-Solomon bytes per codeword repair up to parity/2 bad bytes in each.
+    //depth codewords are interleaved against bursts, more when a full frame would not fit in 255-byte codewords.
+    fecParity = parity;
+    if (fecParity < 0) {
+        fecParity = 0;
+    }
+    else if (fecParity > FEC_MAX_PARITY) {
+        fecParity = FEC_MAX_PARITY;
+    }
+    fecDepth = depth;
+    if (fecDepth < 1) {
+        fecDepth = 1;
+    }
+    else if (fecDepth > FEC_MAX_DEPTH) {
+        fecDepth = FEC_MAX_DEPTH;
+    }
+    int codewordData = 255 - fecParity;
+    int minDepth = (MASK_SIZE + MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + codewordData - 1) / codewordData;
+    if (fecDepth < minDepth) {
+        fecDepth = minDepth;
+    }
 }
 
-//Debug Functions
-void printByte(unsigned char byte) {
-    printf("%hhx\n", byte);
+void applySettings(const Settings *settings) {
+    configureWindow(settings->arq, settings->window);
+    configureFcs(settings->fcs);
+    configureFec(settings->fecParity, settings->fecDepth);
+    maxPayload = settings->maxPayload;
+    if (maxPayload < 1 || maxPayload > MAX_PAYLOAD_SIZE) {
+        maxPayload = MAX_PAYLOAD_SIZE;
+    }
+    framingMode = settings->framing;
+    if (framingMode != FRAMING_COBS && framingMode != FRAMING_LENGTH) {
+        framingMode = FRAMING_STUFFING;
+    }
+    whitening = settings->whitening != 0 && framingMode == FRAMING_STUFFING;    //The other framings have nothing to escape
+    //A bad bit in a COBS code moves bytes around, and FEC repairs a block that gained or lost a byte
+    //into the wrong bytes. The XOR of the payload often stays the same, so both need at least a CRC-16.
+    if (fcsMode == FCS_BCC && (framingMode == FRAMING_COBS || fecParity > 0)) {
+        configureFcs(FCS_CRC16);
+    }
 }
-void printByteSequence(unsigned char *sequence, int size) {
-    for (size_t i = 0; i < size-1; i++) {
-        printf("%hhx-", sequence[i]);
+
+int *byteSetting(Settings *settings, int type) {
+    //Field of a one-byte parameter, NULL for the others
+    switch (type) {
+        case PARAM_ARQ: return &settings->arq;
+        case PARAM_WINDOW: return &settings->window;
+        case PARAM_FCS: return &settings->fcs;
+        case PARAM_FEC_PARITY: return &settings->fecParity;
+        case PARAM_FEC_DEPTH: return &settings->fecDepth;
+        case PARAM_FRAMING: return &settings->framing;
+        case PARAM_WHITENING: return &settings->whitening;
     }
-    printf("%hhx\n", sequence[size-1]);
+    return NULL;
 }
 
-//----------------TESTED AND VALIDATED UNTIL HERE---------------
+int writeParameters(unsigned char *block, const Settings *settings, int all) {
+    //Type, length and value for each setting, all of them or only those the user gave.
+    //Returns the size of the block.
+    int size = 0;
+    for (int type = PARAM_ARQ; type <= PARAM_WHITENING; type++) {
+        int *value = byteSetting((Settings *) settings, type);
+        if (value != NULL && (all || (settings->explicitMask & (1 << type)))) {
+            block[size++] = type;
+            block[size++] = 1;
+            block[size++] = *value;
+        }
+    }
+    block[size++] = PARAM_MAX_PAYLOAD;
+    block[size++] = 2;
+    block[size++] = settings->maxPayload >> 8;
+    block[size++] = settings->maxPayload & 0xff;
+    return size;
+}
 
-int receivePacket(unsigned char *data, int *size, int *parityReceived) {
-    //Internal State Machine
-    enum STATE_MACHINE {WAIT_FOR_FLAG = 0, BUILDING_HEADER, WAIT_FOR_LAST_FLAG, FILLING_INFO, INFO_FILLED, OVER};
-    unsigned char byteReceived;
-    int bytes = -1;
-    int counter = 0;
-    int state = WAIT_FOR_FLAG;
-    int header = INVALID;
+void readParameters(const unsigned char *block, int size, Settings *settings) {
+    //Missing parameters keep the defaults, unknown ones are skipped so newer peers can add more
+    memset(settings, 0, sizeof(*settings));
+    settings->fecDepth = 1;
+    settings->maxPayload = MAX_PAYLOAD_SIZE;
+    int i = 0;
+    while (i + 2 <= size && i + 2 + block[i + 1] <= size) {
+        int type = block[i];
+        int length = block[i + 1];
+        const unsigned char *value = block + i + 2;
+        i += 2 + length;
+        int *field = byteSetting(settings, type);
+        if (field != NULL && length == 1) {
+            *field = value[0];
+            settings->explicitMask |= 1 << type;
+        }
+        else if (type == PARAM_MAX_PAYLOAD && length == 2) {
+            settings->maxPayload = (value[0] << 8) | value[1];
+        }
+    }
+}
 
-    while(alarmEnabled == 1 && state != OVER){
-        switch (state) {
-            case WAIT_FOR_FLAG:
-                bytes = read(fd,&byteReceived,1);
-                if (bytes == 1 && byteReceived == FLAG) {
-                    data[0] = FLAG;
-                    state = BUILDING_HEADER;
-                }
-                break;
-            case BUILDING_HEADER:
-                bytes = read(fd,&byteReceived,1);
-                if (bytes == 1) {
-                    if (byteReceived == FLAG) {
-                        counter = 0;
-                    }
-                    else {
-                        counter++;
-                        data[counter] = byteReceived;
-                    }
-                }
-                if (counter == 3) {
-                    header = getHeaderType(data, parityReceived);
-                    if (header == INVALID) {
-                        state = WAIT_FOR_FLAG;
-                        counter = 0;
-                    }
-                    else if (header == INFO) {
-                        counter = 0;
-                        state = FILLING_INFO;
-                    }
-                    else {
-                        state = WAIT_FOR_LAST_FLAG;
-                    }
-                }
-                break;
-            case WAIT_FOR_LAST_FLAG:
-                bytes = read(fd,&byteReceived,1);
-                if (bytes == 1 && byteReceived == FLAG) {
-                    state = OVER;
-                }
-                else if (bytes == 1) {
-                    state = WAIT_FOR_FLAG;
-                    counter = 0;
-                }
-                break;
-            case FILLING_INFO:
-                bytes = read(fd,&byteReceived,1);
-                if (bytes == 1 && byteReceived == FLAG) {
-                    *size = counter;
-                    state = INFO_FILLED;
-                }
-                else if (bytes != 0) {
-                    data[counter] = byteReceived;
-                    counter++;
-                }
-                break;
-            case INFO_FILLED:
-                *size = removeStuffing(data, *size);
-                if (getBCC(data, (*size) - 2) != data[(*size) - 2]) {
-                    counter = 0;
+int mergeWindow(int a, int b) {
+    //0 stands for the largest window
+    if (a == 0 || (b != 0 && b < a)) {
+        return b;
+    }
+    return a;
+}
 
-                    state = WAIT_FOR_FLAG;
-                }
-                state = OVER;
-                break;
+void mergeSettings(Settings *agreed, const Settings *local) {
+    //agreed holds the initiator's request. A setting only one end asked for is taken as it is;
+    //when both did, the simpler scheme and the smaller window win, and the stronger check and FEC.
+    const int both = agreed->explicitMask & local->explicitMask;
+    if (!(agreed->explicitMask & (1 << PARAM_ARQ)) || ((both & (1 << PARAM_ARQ)) && local->arq < agreed->arq)) {
+        agreed->arq = local->arq;
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_WINDOW))) {
+        agreed->window = local->window;
+    }
+    else if (both & (1 << PARAM_WINDOW)) {
+        agreed->window = mergeWindow(agreed->window, local->window);
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_FCS)) || ((both & (1 << PARAM_FCS)) && local->fcs > agreed->fcs)) {
+        agreed->fcs = local->fcs;
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_FEC_PARITY)) || ((both & (1 << PARAM_FEC_PARITY)) && local->fecParity > agreed->fecParity)) {
+        agreed->fecParity = local->fecParity;
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_FEC_DEPTH)) || ((both & (1 << PARAM_FEC_DEPTH)) && local->fecDepth > agreed->fecDepth)) {
+        agreed->fecDepth = local->fecDepth;
+    }
+    if (local->maxPayload < agreed->maxPayload) {
+        agreed->maxPayload = local->maxPayload;
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_FRAMING))) {
+        agreed->framing = local->framing;
+    }
+    else if ((both & (1 << PARAM_FRAMING)) && local->framing != agreed->framing) {
+        agreed->framing = FRAMING_STUFFING;     //Two different wishes, keep the classic one
+    }
+    if (!(agreed->explicitMask & (1 << PARAM_WHITENING)) || ((both & (1 << PARAM_WHITENING)) && local->whitening < agreed->whitening)) {
+        agreed->whitening = local->whitening;
+    }
+    agreed->explicitMask |= local->explicitMask;
+}
+
+int answerSet(const unsigned char *parameters, int size) {
+    //Responder: a plain SET keeps our own settings, an extended one is merged with them and the result sent back.
+    //A plain SET after an extended one means our UAs were lost and the initiator gave up on negotiating,
+    //so it gets the agreed block again rather than settings it does not expect.
+    if (size == 0 && agreedSize == 0) {
+        applySettings(&localSettings);
+        return sendUnnumbered(UA, 0, 0);
+    }
+    Settings agreed;
+    if (size > 0) {
+        readParameters(parameters, size, &agreed);
+        mergeSettings(&agreed, &localSettings);
+        agreedSize = writeParameters(agreedBlock, &agreed, TRUE);
+    }
+    else {
+        readParameters(agreedBlock, agreedSize, &agreed);
+    }
+    applySettings(&agreed);
+    return sendUnnumbered(UA, agreedBlock, agreedSize);
+}
+
+int serviceLink(int *type) {
+    //Handles one incoming frame or expired timer in either direction and reports its type.
+    //Returns -1 on a write error.
+    int expired = nextExpiredTimer();
+    if (expired == CONTROL_TIMER) {
+        *type = TIMEOUT;    //Left to sendPacket()
+        return 0;
+    }
+    if (expired >= 0) {
+        *type = TIMEOUT;
+        return handleTimeout(expired);
+    }
+    if (ackPending && bytesAvailable() == 0) {  //About to block and no I frame took the acknowledgement
+        ackPending = FALSE;
+        if (sendSupervision(RR, expectedSeq) != 0) {
+            return -1;
         }
     }
-    return header;
+    unsigned char *frame = readySlot();
+    int msgSize;
+    int seq;
+    *type = receivePacket(frame, &msgSize, &seq);
+    if (*type != INVALID && *type != TIMEOUT) {
+        peerHeard();
+    }
+    if (*type == RR || *type == REJ || *type == SREJ) {
+        return handleAcknowledge(*type, seq);
+    }
+    if (*type == INFO) {
+        if (receivedAck >= 0 && handleAcknowledge(RR, receivedAck) != 0) {
+            return -1;
+        }
+        return handleInfo(frame, msgSize, seq);
+    }
+    if (*type == INFO_ERROR) {
+        return handleDamaged(seq);
+    }
+    if (*type == SET && machine == RECEIVER) {  //Our UA was lost
+        return answerSet(frame, msgSize);
+    }
+    if (*type == UA) {
+        peerParametersSize = msgSize <= MAX_ARRAY_SIZE ? msgSize : 0;
+        memcpy(peerParameters, frame, peerParametersSize);
+    }
+    if (*type == DISC) {
+        discReceived = TRUE;
+    }
+    return 0;
 }
 
 int sendPacket(int type, const unsigned char * data, int dataSize) {
-    unsigned char header[5];
-    unsigned char msg[MAX_ARRAY_SIZE];
     int acknowledge = 0;
-    alarmEnabled = 1;
-    int newSize;
-
-    (void)signal(SIGALRM, alarmHandler);
+    int attempts = 0;
 
     while (!acknowledge) {
-        if (createHeader(header, type, messageParity) != 0) {
-            return -1;
+        if (type == SET && attempts == NEGOTIATION_ATTEMPTS) {
+            dataSize = 0;   //No answer to the extended SET, the peer may only know the plain one
         }
-        if (type != INFO) {
-            if (write(fd, header, 5) != 5) {
-                return -1;
-            }
+        if (sendUnnumbered(type, data, dataSize) != 0) {
+            return -1;
         }
-        else {
-            if (write(fd, header, 4) != 4) {
-                return -1;
-            }
-            for (int i = 0; i < dataSize; i++) {
-                msg[i] = data[i];
-            }
-            msg[dataSize] = getBCC(data, dataSize);
-            msg[dataSize + 1] = FLAG;
-            newSize = addStuffing(msg, dataSize + 1);
-            if (write(fd, msg, newSize) != newSize) {
-                return -1;
-            }
+        attempts++;
+        if (linkLost) {
+            stats.probes++;
         }
+        long long sentAt = nowUs();
 
-        alarm(3);
         int typeResponse;
-        int parityReceived;
 
-        if (type == UA || type == RR || type == REJ) {
+        if (type == UA) {
             acknowledge = 1;
-            alarm(0);
             break;
         }
+        startTimer(CONTROL_TIMER, linkLost ? probeUs : rtoUs);     //Each SET or DISC sent while down is a probe
 
-        typeResponse = receivePacket(msg, 0, &parityReceived);
-
-        if (type == SET) {
-            if (typeResponse == UA) {
-                acknowledge = 1;
-                alarm(0);
-            }
-        }
-        else if (type == DISC) {
-            if (machine == TRANSMITTER) {
-                if (typeResponse == DISC) {
-                    acknowledge = 1;
-                    alarm(0);
-                }
+        while (!acknowledge && !timerExpired(CONTROL_TIMER)) {     //Frames of the other direction keep flowing meanwhile
+            if (serviceLink(&typeResponse) != 0) {
+                return -1;
             }
-            else if (machine == RECEIVER) {
+            if (type == SET) {
                 if (typeResponse == UA) {
                     acknowledge = 1;
-                    alarm(0);
                 }
             }
-        }
-        else if (type == INFO) {
-            if (typeResponse == REJ) {
-                continue;
-            }
-            if (typeResponse == RR && parityReceived != messageParity) {
-                acknowledge = 1;
-                alarm(0);
-                if (messageParity == 0) {
-                    messageParity = 1;
+            else if (type == DISC) {
+                if (machine == TRANSMITTER) {
+                    if (typeResponse == DISC) {
+                        acknowledge = 1;
+                    }
                 }
-                else if (messageParity == 1) {
-                    messageParity = 0;
+                else if (machine == RECEIVER) {
+                    if (typeResponse == UA) {
+                        acknowledge = 1;
+                    }
                 }
             }
         }
-        alarmEnabled = 1;
+        stopTimer(CONTROL_TIMER);
+        if (acknowledge) {
+            if (attempts == 1) {
+                updateRto(nowUs() - sentAt);
+            }
+        }
+        else {
+            noteTimeout(TRUE);
+        }
+    }
+    return 0;
+}
+
+int waitForWindow(int maxOutstanding) {
+    //Processes incoming frames until at most maxOutstanding frames are in flight
+    //Also drains acknowledgements that are already waiting, without blocking. No new frame goes out while the link is down.
+    while (outstandingFrames() > maxOutstanding || (outstandingFrames() > 0 && (bytesAvailable() > 0 || linkLost))) {
+        int type;
+        if (serviceLink(&type) != 0) {
+            return -1;
+        }
     }
     return 0;
 }
 
+int sendInfo(const unsigned char *prefix, int prefixSize, const unsigned char *data, int dataSize) {
+    //The frame's payload is prefix followed by data, prefix may be empty
+    if (prefixSize + dataSize > maxPayload) {
+        return -1;
+    }
+    if (waitForWindow(windowSize - 1) != 0) {
+        return -1;
+    }
+    int size = buildInfoFrame(txFrames[nextSeq], nextSeq, prefix, prefixSize, data, dataSize);
+    if (size < 0) {
+        return -1;
+    }
+    txFrameSizes[nextSeq] = size;
+    if (seqModulus == EXTENDED_MODULUS) {
+        if (prefixSize > 0) {
+            memcpy(txPayloads[nextSeq], prefix, prefixSize);
+        }
+        memcpy(txPayloads[nextSeq] + prefixSize, data, dataSize);
+        txPayloadSizes[nextSeq] = prefixSize + dataSize;
+    }
+    txTransmissions[nextSeq] = 0;
+    if (transmitFrame(nextSeq) != 0) {
+        return -1;
+    }
+    stats.framesSent++;
+    if (ackPending && seqModulus == EXTENDED_MODULUS) {  //N(r) went out in the control field
+        ackPending = FALSE;
+        stats.piggybacked++;
+    }
+    if (outstandingFrames() == 0 && arqMode != SELECTIVE_REPEAT) {
+        startTimer(WINDOW_TIMER, rtoUs);
+    }
+    nextSeq = (nextSeq + 1) % seqModulus;
+
+    //Stop-and-wait only returns once the frame is confirmed
+    return waitForWindow(arqMode == STOP_AND_WAIT ? 0 : windowSize - 1);
+}
+
+void configureTimeout(int timeoutSeconds) {
+    //LinkLayer.timeout is the RTO until the first RTT sample, LL_RTO_MIN/LL_RTO_MAX bound it (ms)
+    rtoUs = timeoutSeconds > 0 ? timeoutSeconds * 1000000LL : 3000000;
+    initialRtoUs = rtoUs;
+    rtoMinUs = readOption("LL_RTO_MIN", 10) * 1000LL;
+    rtoMaxUs = readOption("LL_RTO_MAX", 60000) * 1000LL;
+    if (rtoMaxUs < rtoMinUs) {
+        rtoMaxUs = rtoMinUs;
+    }
+    probeMaxUs = readOption("LL_PROBE_MAX", 1000) * 1000LL;
+    if (probeMaxUs < rtoMinUs) {
+        probeMaxUs = rtoMinUs;
+    }
+    srttUs = 0;
+    rttvarUs = 0;
+    rttSamples = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void printStatistics() {
+    printf("Link layer statistics\n"
+           "  - Baud rate: %d\n"
+           "  - ARQ: %s, window %d, FEC parity %d x %d, payload up to %d bytes\n"
+           "  - Frames sent: %d\n"
+           "  - Retransmissions: %d\n"
+           "  - Timeouts: %d\n"
+           "  - REJ/SREJ received: %d\n"
+           "  - Frames received: %d\n"
+           "  - Duplicates received: %d\n"
+           "  - REJ/SREJ sent: %d\n"
+           "  - RTT samples: %d\n"
+           "  - Smoothed RTT: %.3f ms\n"
+           "  - RTT variance: %.3f ms\n"
+           "  - Retransmission timeout: %.3f ms\n"
+           "  - Frames parsed: %d\n"
+           "  - read() calls: %lld (%.2f per frame, %.1f bytes each)\n"
+           "  - poll() calls: %lld\n"
+           "  - Frame check: %s\n"
+           "  - Framing: %s, %lld body bytes sent as %lld (%+.2f%%)\n"
+           "  - Whitening: %s, %d frames masked\n"
+           "  - FEC corrected bytes: %d\n"
+           "  - Acknowledgements piggybacked: %d\n"
+           "  - Link outages: %d, %.3f s down, %d probes, %.3f ms to recover\n",
+           lineRate,
+           arqMode == SELECTIVE_REPEAT ? "selective repeat" : arqMode == GO_BACK_N ? "go-back-n" : "stop-and-wait",
+           windowSize,
+           fecParity,
+           fecDepth,
+           maxPayload,
+           stats.framesSent,
+           stats.retransmissions,
+           stats.timeouts,
+           stats.rejReceived,
+           stats.framesReceived,
+           stats.duplicatesReceived,
+           stats.rejSent,
+           rttSamples,
+           srttUs / 1000.0,
+           rttvarUs / 1000.0,
+           rtoUs / 1000.0,
+           stats.framesParsed,
+           stats.readCalls,
+           stats.framesParsed > 0 ? (double) stats.readCalls / stats.framesParsed : 0.0,
+           stats.readCalls > 0 ? (double) stats.bytesRead / stats.readCalls : 0.0,
+           stats.pollCalls,
+           fcsMode == FCS_CRC32 ? "CRC-32" : fcsMode == FCS_CRC16 ? "CRC-16" : "BCC2",
+           framingMode == FRAMING_COBS ? "COBS" : framingMode == FRAMING_LENGTH ? "length field" : "byte stuffing",
+           stats.bodyBytes,
+           stats.framedBytes,
+           stats.bodyBytes > 0 ? 100.0 * (stats.framedBytes - stats.bodyBytes) / stats.bodyBytes : 0.0,
+           whitening ? "on" : "off",
+           stats.framesMasked,
+           stats.fecCorrected,
+           stats.piggybacked,
+           stats.outages,
+           stats.downUs / 1000000.0,
+           stats.probes,
+           stats.recoveryUs / 1000.0);
+}
+
 int llopen(LinkLayer connectionParameters) {
     if (connectionParameters.role == LlTx) {
         machine = TRANSMITTER;
-        messageParity = 0;
     } else if (connectionParameters.role == LlRx) {
         machine = RECEIVER;
-        messageParity = 1;
     }
+    readSettings(&localSettings);
+    applySettings(&localSettings);
+    configureTimeout(connectionParameters.timeout);
+    maxTimeouts = connectionParameters.nRetransmissions > 0 ? connectionParameters.nRetransmissions : 3;
+    consecutiveTimeouts = 0;
+    linkLost = FALSE;
+    restoredUs = 0;
 
     fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
 
@@ -459,17 +1788,16 @@ int llopen(LinkLayer connectionParameters) {
     // Clear struct for new port settings
     memset(&newtio, 0, sizeof(newtio));
 
-    newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+    int requestedRate = readOption("LL_BAUD", connectionParameters.baudRate);
+    int constant = baudConstant(requestedRate);
+    newtio.c_cflag = (constant >= 0 ? constant : BAUDRATE) | CS8 | CLOCAL | CREAD;
     newtio.c_iflag = IGNPAR;
     newtio.c_oflag = 0;
 
     // Set input mode (non-canonical, no echo,...)
     newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 1; // Inter-character timer unused
-    newtio.c_cc[VMIN] = 0;  // Blocking read until 5 chars received
-
-    // VTIME e VMIN should be changed in order to protect with a
-    // timeout the reception of the following character(s)
+    newtio.c_cc[VTIME] = 0; // Reads never block: readByte() waits in poll()
+    newtio.c_cc[VMIN] = 0;  // alongside the timerfd, so no periodic wakeups
 
     // Now clean the line and activate the settings for the port
     // tcflush() discards data written to the object referred to
@@ -486,19 +1814,45 @@ int llopen(LinkLayer connectionParameters) {
 
     printf("New termios structure set\n");
 
+    lineRate = setBaudRate(fd, requestedRate);
+    if (lineRate < 0) {
+        perror("setBaudRate");
+        exit(-1);
+    }
+    printf("Baud rate: %d (requested %d)\n", lineRate, requestedRate);
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+        perror("timerfd_create");
+        exit(-1);
+    }
+    memset(timerDeadline, 0, sizeof(timerDeadline));
+    rxRingHead = 0;
+    rxRingTail = 0;
+    lastHeardUs = nowUs();
+
     unsigned char packet[MAX_ARRAY_SIZE];
     
     if (machine == TRANSMITTER) {
-        if (sendPacket(SET, packet, 0) != 0) {
+        //Ask for what the user set, the receiver answers with the settings both ends will use
+        int packetSize = writeParameters(packet, &localSettings, FALSE);
+        peerParametersSize = 0;
+        if (sendPacket(SET, packet, packetSize) != 0) {
             return -1;
         }
+        if (peerParametersSize > 0) {
+            Settings agreed;
+            readParameters(peerParameters, peerParametersSize, &agreed);
+            applySettings(&agreed);
+        }
         return 1;
     }
     else if (machine == RECEIVER) {
         int parityReceived, size;
-        int type = receivePacket(packet, &size, &parityReceived);
+        agreedSize = 0;
+        int type = receivePacket(spareFrame, &size, &parityReceived);
         if (type == SET) {
-            if (sendPacket(UA, packet, 0) != 0) {
+            if (answerSet(spareFrame, size) != 0) {
                 return -1;
             }
         }
@@ -514,52 +1868,113 @@ int llopen(LinkLayer connectionParameters) {
 // LLWRITE
 ////////////////////////////////////////////////
     int llwrite(const unsigned char *buf, int bufSize) {
-        if(machine == TRANSMITTER){
-            if(sendPacket(INFO, buf, bufSize) != 0){
-                return -1;
-            }
+        //Either end may write, frames from the peer are handled while we wait for the window
+        if(sendInfo(NULL, 0, buf, bufSize) != 0){
+            return -1;
         }
 
         return bufSize;
     }
 
+////////////////////////////////////////////////
+// LLSENDFILE
+////////////////////////////////////////////////
+    static __thread sigjmp_buf *pagesGone;     //Set while llsendfile() builds frames from a mapping
+
+    static void onBusError(int sig) {
+        //Pages past the end of a file that shrank under the mapping: that llsendfile() fails
+        if (pagesGone != NULL) {
+            siglongjmp(*pagesGone, 1);
+        }
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+
+    long long llsendfile(int fileFd, long long offset, long long length, int chunk, PacketHeader header, void *context) {
+        //The mapping starts on the page holding offset. Stuffing reads the pages into the frame kept
+        //for retransmission, so they may go as soon as the last frame is built.
+        if (length <= 0) {
+            return 0;
+        }
+        if (chunk <= 0) {
+            return -1;
+        }
+        long long start = offset - offset % sysconf(_SC_PAGESIZE);
+        size_t mapped = length + (offset - start);
+        unsigned char *map = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fileFd, start);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, mapped, MADV_SEQUENTIAL);
+        struct sigaction action = {0};
+        action.sa_handler = onBusError;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, NULL);
+        sigjmp_buf fault;
+        if (sigsetjmp(fault, 1) != 0) {
+            pagesGone = NULL;
+            printf("The file shrank while it was being sent\n");
+            munmap(map, mapped);
+            return -1;
+        }
+        const unsigned char *data = map + (offset - start);
+        unsigned char prefix[LL_MAX_PACKET_HEADER];
+        long long sent = 0;
+        while (sent < length) {
+            int size = length - sent < chunk ? length - sent : chunk;
+            //A cut between frames shows here, the SIGBUS guard covers one while a frame is built
+            struct stat info;
+            if (fstat(fileFd, &info) != 0 || info.st_size < offset + sent + size) {
+                printf("The file shrank while it was being sent\n");
+                munmap(map, mapped);
+                return -1;
+            }
+            int prefixSize = header(context, prefix, offset + sent, size);
+            pagesGone = &fault;
+            int result = prefixSize < 0 || prefixSize > LL_MAX_PACKET_HEADER ? -1 : sendInfo(prefix, prefixSize, data + sent, size);
+            pagesGone = NULL;
+            if (result != 0) {
+                munmap(map, mapped);
+                return -1;
+            }
+            sent += size;
+        }
+        munmap(map, mapped);
+        return sent;
+    }
+
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
     int llread(unsigned char *packet) {
-        if(machine == RECEIVER) {
-            int msgSize;
-            int parityReceived;
-            int type = receivePacket(packet, &msgSize, &parityReceived);
-            if (type == INFO) {
-                if (parityReceived != messageParity) {
-                    if (sendPacket(RR, 0, 0) != 0) {
-                        return -1;
-                    }
-                    if (messageParity == 0) {
-                        messageParity = 1;
-                    }
-                    else if (messageParity == 1) {
-                        messageParity = 0;
-                    }
-                    else {
-                        return -1;
-                    }
-                }
-                else {
-                    printf("Wrong parity-llread\n");
+        //Returns 0 once the peer disconnected
+        while (readyCount == 0) {
+            if (discReceived) {
+                discReceived = FALSE;
+                if (waitForWindow(0) != 0) {    //Our own frames are confirmed first
                     return -1;
                 }
-                return msgSize;
-            }
-            else if (type == DISC) {
                 if (sendPacket(DISC, 0, 0) != 0) {
                     return -1;
                 }
                 return 0;
             }
+            int type;
+            if (serviceLink(&type) != 0) {
+                return -1;
+            }
         }
-        return 0;
+        int size = readySizes[readyHead];
+        memcpy(packet, readyFrames[readyHead], size);
+        readyHead = (readyHead + 1) % READY_SLOTS;
+        readyCount--;
+        if (arqMode == SELECTIVE_REPEAT) {
+            drainStored();
+            if (acknowledgeReceived() != 0) {
+                return -1;
+            }
+        }
+        return size;
     }
 
 
@@ -569,17 +1984,24 @@ int llopen(LinkLayer connectionParameters) {
     int llclose(int showStatistics) {
         unsigned char packet[MAX_ARRAY_SIZE];
         if(machine == TRANSMITTER){
-            if(sendPacket(DISC, packet, 0) != 0){
+            if(waitForWindow(0) != 0){
                 return -1;
             }
-            int size, parityReceived;
-            int type = receivePacket(packet, &size, &parityReceived);
-            if(type == DISC){
-                if(sendPacket(UA, packet, 0) != 0){
-                    return -1;
-                }
+            if(sendPacket(DISC, packet, 0) != 0){     //Returns once the receiver's DISC arrived
+                return -1;
+            }
+            if(sendPacket(UA, packet, 0) != 0){
+                return -1;
             }
         }
+        if(ackPending){     //Nothing else will carry it
+            ackPending = FALSE;
+            sendSupervision(RR, expectedSeq);
+        }
+        if(showStatistics){
+            printStatistics();
+        }
+        close(timerFd);
+        timerFd = -1;
         return 1;
     }
-
@@ -0,0 +1,495 @@
+// LZ77 over hash chains with lazy matching, then canonical Huffman codes limited to
+// 12 bits so the decoder resolves every symbol with one table lookup.
+// Lengths and distances are sent as a bucket symbol plus extra bits: values below
+// 16 (lengths) or 4 (distances) have their own symbol, larger ones are split by their
+// top two bits, so each power of two costs two symbols.
+// The bit stream is least significant bit first.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lzh.h"
+
+#define MIN_MATCH 4
+#define MAX_MATCH (MIN_MATCH + 65535)
+#define FAR_MATCH (1 << 16)         //Shortest matches are not worth a distance this long
+#define END_SYMBOL 256
+#define LENGTH_CODES 40
+#define DISTANCE_CODES 44
+#define LITERAL_SYMBOLS (END_SYMBOL + 1 + LENGTH_CODES)
+#define MAX_CODE_LENGTH 12
+#define TABLE_SIZE (1 << MAX_CODE_LENGTH)
+#define HASH_LOG 15
+#define MAX_CHAIN 48                //Candidates tried per position
+#define GOOD_MATCH 64               //Long enough to skip the lazy step
+
+typedef struct {
+    uint32_t length;    //0 for a literal
+    uint32_t value;     //The literal, or the distance
+} Token;
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hashAt(const unsigned char *p) {
+    return (read32(p) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static int bucketCode(uint32_t value, int direct, int firstLog) {
+    //Symbol of a length (direct 16) or distance (direct 4) and the number of extra bits
+    if (value < (uint32_t) direct) {
+        return value;
+    }
+    int n = 31 - __builtin_clz(value);
+    return direct + (n - firstLog) * 2 + ((value >> (n - 1)) & 1);
+}
+
+static int bucketExtraBits(int code, int direct, int firstLog) {
+    return code < direct ? 0 : (code - direct) / 2 + firstLog - 1;
+}
+
+static uint32_t bucketBase(int code, int direct, int firstLog) {
+    if (code < direct) {
+        return code;
+    }
+    int n = (code - direct) / 2 + firstLog;
+    return (uint32_t) (2 | ((code - direct) & 1)) << (n - 1);
+}
+
+#define LENGTH_CODE(l) bucketCode(l, 16, 4)
+#define DISTANCE_CODE(d) bucketCode(d, 4, 2)
+
+////////////////////////////////////////////////
+// Match finding
+////////////////////////////////////////////////
+
+typedef struct {
+    const unsigned char *src;
+    int size;
+    int *head;
+    int *prev;
+} Matcher;
+
+static void insertPosition(Matcher *m, int pos) {
+    if (pos + MIN_MATCH <= m->size) {
+        int h = hashAt(m->src + pos);
+        m->prev[pos] = m->head[h];
+        m->head[h] = pos;
+    }
+}
+
+static int findMatch(const Matcher *m, int pos, int *distance) {
+    //Longest earlier match for pos, 0 if none reaches MIN_MATCH
+    if (pos + MIN_MATCH > m->size) {
+        return 0;
+    }
+    const unsigned char *src = m->src;
+    int maxLength = m->size - pos < MAX_MATCH ? m->size - pos : MAX_MATCH;
+    int best = MIN_MATCH - 1;
+    int candidate = m->head[hashAt(src + pos)];
+    for (int depth = 0; candidate >= 0 && depth < MAX_CHAIN; depth++) {
+        if (src[candidate + best] == src[pos + best] && read32(src + candidate) == read32(src + pos)) {
+            int length = MIN_MATCH;
+            while (length < maxLength && src[candidate + length] == src[pos + length]) {
+                length++;
+            }
+            if (length > best && (length > MIN_MATCH || pos - candidate <= FAR_MATCH)) {
+                best = length;
+                *distance = pos - candidate;
+                if (length == maxLength) {
+                    break;
+                }
+            }
+        }
+        candidate = m->prev[candidate];
+    }
+    return best >= MIN_MATCH ? best : 0;
+}
+
+static int parse(Token *tokens, const unsigned char *src, int size) {
+    //Returns the number of tokens, or -1 without memory
+    Matcher m = {src, size, malloc(sizeof(int) << HASH_LOG), malloc(sizeof(int) * (size_t) size)};
+    if (m.head == NULL || m.prev == NULL) {
+        free(m.head);
+        free(m.prev);
+        return -1;
+    }
+    memset(m.head, -1, sizeof(int) << HASH_LOG);
+    int count = 0;
+    int pos = 0;
+    while (pos < size) {
+        int distance = 0;
+        int length = findMatch(&m, pos, &distance);
+        insertPosition(&m, pos);
+        if (length > 0 && length < GOOD_MATCH) {
+            int nextDistance;
+            if (findMatch(&m, pos + 1, &nextDistance) > length) {
+                length = 0;     //A literal now buys a longer match at the next byte
+            }
+        }
+        if (length == 0) {
+            tokens[count].length = 0;
+            tokens[count++].value = src[pos++];
+            continue;
+        }
+        tokens[count].length = length;
+        tokens[count++].value = distance;
+        for (int i = 1; i < length; i++) {
+            insertPosition(&m, pos + i);
+        }
+        pos += length;
+    }
+    free(m.head);
+    free(m.prev);
+    return count;
+}
+
+////////////////////////////////////////////////
+// Huffman codes
+////////////////////////////////////////////////
+
+static int ascending(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void buildLengths(unsigned char *lengths, const uint32_t *frequencies, int symbols) {
+    //Huffman code lengths, then the longest codes are folded into MAX_CODE_LENGTH bits
+    uint64_t sorted[LITERAL_SYMBOLS];   //Frequency above the symbol, so one sort orders both
+    int order[LITERAL_SYMBOLS];
+    int used = 0;
+    memset(lengths, 0, symbols);
+    for (int s = 0; s < symbols; s++) {
+        if (frequencies[s] > 0) {
+            sorted[used++] = (uint64_t) frequencies[s] << 16 | s;
+        }
+    }
+    if (used == 1) {
+        lengths[sorted[0] & 0xffff] = 1;
+    }
+    if (used <= 1) {
+        return;
+    }
+    qsort(sorted, used, sizeof(uint64_t), ascending);
+    for (int i = 0; i < used; i++) {
+        order[i] = sorted[i] & 0xffff;
+    }
+
+    //Two queues: sorted leaves, then internal nodes in the order they are made
+    uint64_t weight[2 * LITERAL_SYMBOLS];
+    int parent[2 * LITERAL_SYMBOLS];
+    for (int i = 0; i < used; i++) {
+        weight[i] = frequencies[order[i]];
+    }
+    int leaf = 0;
+    int node = used;
+    int nextNode = used;
+    for (int made = 0; made < used - 1; made++) {
+        int pick[2];
+        for (int k = 0; k < 2; k++) {
+            if (leaf < used && (node >= nextNode || weight[leaf] <= weight[node])) {
+                pick[k] = leaf++;
+            }
+            else {
+                pick[k] = node++;
+            }
+        }
+        weight[nextNode] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = nextNode;
+        parent[pick[1]] = nextNode;
+        nextNode++;
+    }
+    int depth[2 * LITERAL_SYMBOLS];
+    depth[nextNode - 1] = 0;
+    int counts[64] = {0};
+    for (int i = nextNode - 2; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < used) {
+            counts[depth[i] < MAX_CODE_LENGTH ? depth[i] : MAX_CODE_LENGTH]++;
+        }
+    }
+    //Clamping broke the Kraft sum: push codes down from shorter lengths until it holds
+    uint32_t total = 0;
+    for (int l = 1; l <= MAX_CODE_LENGTH; l++) {
+        total += counts[l] << (MAX_CODE_LENGTH - l);
+    }
+    while (total > (1U << MAX_CODE_LENGTH)) {
+        counts[MAX_CODE_LENGTH]--;
+        for (int l = MAX_CODE_LENGTH - 1; l > 0; l--) {
+            if (counts[l] > 0) {
+                counts[l]--;
+                counts[l + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    //Most frequent symbols take the shortest codes
+    int i = used - 1;
+    for (int l = 1; l <= MAX_CODE_LENGTH; l++) {
+        for (int k = 0; k < counts[l]; k++) {
+            lengths[order[i--]] = l;
+        }
+    }
+}
+
+static int assignCodes(uint16_t *codes, const unsigned char *lengths, int symbols) {
+    //Canonical codes, bit reversed for the LSB-first stream. Returns -1 if oversubscribed.
+    int counts[MAX_CODE_LENGTH + 1] = {0};
+    for (int s = 0; s < symbols; s++) {
+        counts[lengths[s]]++;
+    }
+    counts[0] = 0;
+    uint32_t next[MAX_CODE_LENGTH + 2];
+    uint32_t code = 0;
+    uint32_t kraft = 0;
+    for (int l = 1; l <= MAX_CODE_LENGTH; l++) {
+        code = (code + counts[l - 1]) << 1;
+        next[l] = code;
+        kraft += counts[l] << (MAX_CODE_LENGTH - l);
+    }
+    if (kraft > TABLE_SIZE) {
+        return -1;
+    }
+    for (int s = 0; s < symbols; s++) {
+        int l = lengths[s];
+        if (l > 0) {
+            uint32_t c = next[l]++;
+            uint16_t reversed = 0;
+            for (int b = 0; b < l; b++) {
+                reversed |= ((c >> b) & 1) << (l - 1 - b);
+            }
+            codes[s] = reversed;
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// Bit stream
+////////////////////////////////////////////////
+
+typedef struct {
+    unsigned char *out;
+    unsigned char *end;
+    uint64_t bits;
+    int count;
+    int overflow;
+} BitWriter;
+
+static void putBits(BitWriter *w, uint32_t value, int n) {
+    if (w->overflow) {
+        return;
+    }
+    w->bits |= (uint64_t) value << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        if (w->out == w->end) {
+            w->overflow = 1;
+            return;
+        }
+        *w->out++ = (unsigned char) w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+typedef struct {
+    const unsigned char *in;
+    const unsigned char *end;
+    uint64_t bits;
+    int count;
+    long long left;     //Bits of real input not consumed yet, negative once past the end
+} BitReader;
+
+static void refill(BitReader *r) {
+    while (r->count <= 56) {
+        uint64_t byte = r->in < r->end ? *r->in++ : 0;
+        r->bits |= byte << r->count;
+        r->count += 8;
+    }
+}
+
+static uint32_t getBits(BitReader *r, int n) {
+    if (n == 0) {
+        return 0;
+    }
+    refill(r);
+    uint32_t value = r->bits & ((1ULL << n) - 1);
+    r->bits >>= n;
+    r->count -= n;
+    r->left -= n;
+    return value;
+}
+
+static int buildTable(uint16_t *table, const unsigned char *lengths, int symbols) {
+    //Entry: symbol << 4 | length, length 0 where no code leads
+    uint16_t codes[LITERAL_SYMBOLS];
+    if (assignCodes(codes, lengths, symbols) != 0) {
+        return -1;
+    }
+    memset(table, 0, sizeof(uint16_t) * TABLE_SIZE);
+    for (int s = 0; s < symbols; s++) {
+        int l = lengths[s];
+        if (l > 0) {
+            for (int j = codes[s]; j < TABLE_SIZE; j += 1 << l) {
+                table[j] = (s << 4) | l;
+            }
+        }
+    }
+    return 0;
+}
+
+static int getSymbol(BitReader *r, const uint16_t *table) {
+    refill(r);
+    uint16_t entry = table[r->bits & (TABLE_SIZE - 1)];
+    int l = entry & 15;
+    if (l == 0) {
+        return -1;
+    }
+    r->bits >>= l;
+    r->count -= l;
+    r->left -= l;
+    return r->left < 0 ? -1 : entry >> 4;
+}
+
+////////////////////////////////////////////////
+// Blocks
+////////////////////////////////////////////////
+
+int lzhCompress(unsigned char *dst, int dstCapacity, const unsigned char *src, int size) {
+    if (size <= 0 || size > LZH_MAX_BLOCK) {
+        return -1;
+    }
+    if (dstCapacity > size - 1) {
+        dstCapacity = size - 1;
+    }
+    Token *tokens = malloc(sizeof(Token) * (size_t) size);
+    if (tokens == NULL) {
+        return -1;
+    }
+    int count = parse(tokens, src, size);
+    if (count < 0) {
+        free(tokens);
+        return -1;
+    }
+
+    uint32_t literalFrequencies[LITERAL_SYMBOLS] = {0};
+    uint32_t distanceFrequencies[DISTANCE_CODES] = {0};
+    for (int i = 0; i < count; i++) {
+        if (tokens[i].length == 0) {
+            literalFrequencies[tokens[i].value]++;
+        }
+        else {
+            literalFrequencies[END_SYMBOL + 1 + LENGTH_CODE(tokens[i].length - MIN_MATCH)]++;
+            distanceFrequencies[DISTANCE_CODE(tokens[i].value - 1)]++;
+        }
+    }
+    literalFrequencies[END_SYMBOL] = 1;
+    unsigned char literalLengths[LITERAL_SYMBOLS];
+    unsigned char distanceLengths[DISTANCE_CODES];
+    uint16_t literalCodes[LITERAL_SYMBOLS];
+    uint16_t distanceCodes[DISTANCE_CODES];
+    buildLengths(literalLengths, literalFrequencies, LITERAL_SYMBOLS);
+    buildLengths(distanceLengths, distanceFrequencies, DISTANCE_CODES);
+    assignCodes(literalCodes, literalLengths, LITERAL_SYMBOLS);
+    assignCodes(distanceCodes, distanceLengths, DISTANCE_CODES);
+
+    BitWriter w = {dst, dst + (dstCapacity > 0 ? dstCapacity : 0), 0, 0, 0};
+    for (int s = 0; s < LITERAL_SYMBOLS; s++) {
+        putBits(&w, literalLengths[s], 4);
+    }
+    for (int s = 0; s < DISTANCE_CODES; s++) {
+        putBits(&w, distanceLengths[s], 4);
+    }
+    for (int i = 0; i < count && !w.overflow; i++) {
+        if (tokens[i].length == 0) {
+            putBits(&w, literalCodes[tokens[i].value], literalLengths[tokens[i].value]);
+            continue;
+        }
+        uint32_t length = tokens[i].length - MIN_MATCH;
+        int code = LENGTH_CODE(length);
+        int symbol = END_SYMBOL + 1 + code;
+        putBits(&w, literalCodes[symbol], literalLengths[symbol]);
+        putBits(&w, length - bucketBase(code, 16, 4), bucketExtraBits(code, 16, 4));
+        uint32_t distance = tokens[i].value - 1;
+        code = DISTANCE_CODE(distance);
+        putBits(&w, distanceCodes[code], distanceLengths[code]);
+        putBits(&w, distance - bucketBase(code, 4, 2), bucketExtraBits(code, 4, 2));
+    }
+    free(tokens);
+    putBits(&w, literalCodes[END_SYMBOL], literalLengths[END_SYMBOL]);
+    putBits(&w, 0, 7);  //Flush the last partial byte
+    if (w.overflow) {
+        return -1;
+    }
+    return w.out - dst;
+}
+
+int lzhDecompress(unsigned char *dst, int dstCapacity, const unsigned char *src, int size) {
+    BitReader r = {src, src + size, 0, 0, (long long) size * 8};
+    unsigned char literalLengths[LITERAL_SYMBOLS];
+    unsigned char distanceLengths[DISTANCE_CODES];
+    for (int s = 0; s < LITERAL_SYMBOLS; s++) {
+        literalLengths[s] = getBits(&r, 4);
+    }
+    for (int s = 0; s < DISTANCE_CODES; s++) {
+        distanceLengths[s] = getBits(&r, 4);
+    }
+    for (int s = 0; s < LITERAL_SYMBOLS + DISTANCE_CODES; s++) {
+        int l = s < LITERAL_SYMBOLS ? literalLengths[s] : distanceLengths[s - LITERAL_SYMBOLS];
+        if (l > MAX_CODE_LENGTH) {
+            return -1;
+        }
+    }
+    uint16_t literalTable[TABLE_SIZE];
+    uint16_t distanceTable[TABLE_SIZE];
+    if (r.left < 0 || buildTable(literalTable, literalLengths, LITERAL_SYMBOLS) != 0
+        || buildTable(distanceTable, distanceLengths, DISTANCE_CODES) != 0) {
+        return -1;
+    }
+
+    unsigned char *out = dst;
+    unsigned char *outEnd = dst + dstCapacity;
+    while (1) {
+        int symbol = getSymbol(&r, literalTable);
+        if (symbol < 0) {
+            return -1;
+        }
+        if (symbol < END_SYMBOL) {
+            if (out == outEnd) {
+                return -1;
+            }
+            *out++ = symbol;
+            continue;
+        }
+        if (symbol == END_SYMBOL) {
+            break;
+        }
+        int code = symbol - END_SYMBOL - 1;
+        uint32_t length = bucketBase(code, 16, 4) + getBits(&r, bucketExtraBits(code, 16, 4)) + MIN_MATCH;
+        code = getSymbol(&r, distanceTable);
+        if (code < 0) {
+            return -1;
+        }
+        uint32_t distance = bucketBase(code, 4, 2) + getBits(&r, bucketExtraBits(code, 4, 2)) + 1;
+        if (r.left < 0 || distance > (uint32_t) (out - dst) || length > (uint32_t) (outEnd - out)) {
+            return -1;
+        }
+        const unsigned char *match = out - distance;
+        if (distance >= length) {
+            memcpy(out, match, length);
+            out += length;
+        }
+        else {
+            for (uint32_t i = 0; i < length; i++) {    //Overlapping copy repeats the last distance bytes
+                *out++ = match[i];
+            }
+        }
+    }
+    return out - dst;
+}
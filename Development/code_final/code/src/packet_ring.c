@@ -0,0 +1,200 @@
+// Packet ring: buffer i % count holds the i-th packet. The producer alone advances head
+// (packets queued) and the consumer alone advances tail (packets given back), so the
+// queued ones are tail to head - 1 and a side only reads the other's counter.
+// Sleeping goes through the mutex: a sleeper counts itself in sleepers and checks the
+// ring again before it waits, a side that moved its counter then looks at sleepers.
+// Both steps are sequentially consistent, so one of them always sees the other.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include "packet_ring.h"
+
+typedef struct {
+    int size;
+    long long tag;
+} Entry;
+
+struct PacketRing {
+    unsigned char *data;
+    Entry *entries;
+    int count;
+    int size;
+    atomic_llong head;
+    atomic_llong tail;
+    atomic_int closed;
+    atomic_int aborted;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    RingStatistics stats;   //Producer fields and consumer fields, each written by its own side
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int hasRoom(PacketRing *r) {
+    return atomic_load(&r->head) - atomic_load(&r->tail) < r->count || atomic_load(&r->aborted);
+}
+
+static int hasPacket(PacketRing *r) {
+    return atomic_load(&r->head) != atomic_load(&r->tail) || atomic_load(&r->closed);
+}
+
+static double sleepUntil(PacketRing *r, int (*ready)(PacketRing *), const struct timespec *deadline) {
+    //Returns the time slept. With a deadline (CLOCK_MONOTONIC), gives up once it has passed.
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->sleepers, 1);
+    while (!ready(r)) {
+        if (deadline == NULL) {
+            pthread_cond_wait(&r->wake, &r->lock);
+        }
+        else if (pthread_cond_timedwait(&r->wake, &r->lock, deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    atomic_fetch_sub(&r->sleepers, 1);
+    pthread_mutex_unlock(&r->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(&start, &end);
+}
+
+static void wakeSleepers(PacketRing *r) {
+    //The mutex is only held by a sleeper between its last check and its wait
+    if (atomic_load(&r->sleepers) > 0) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+PacketRing *createRing(int count, int size, int alignment) {
+    PacketRing *r = calloc(1, sizeof(PacketRing));
+    if (r == NULL) {
+        return NULL;
+    }
+    void *data = NULL;
+    r->entries = calloc(count, sizeof(Entry));
+    if (count < 1 || size < 1 || r->entries == NULL
+        || posix_memalign(&data, alignment, (size_t) count * size) != 0) {
+        free(r->entries);
+        free(r);
+        return NULL;
+    }
+    r->data = data;
+    r->count = count;
+    r->size = size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->closed, 0);
+    atomic_init(&r->aborted, 0);
+    atomic_init(&r->sleepers, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    return r;
+}
+
+unsigned char *ringReserve(PacketRing *r) {
+    if (!hasRoom(r)) {
+        r->stats.fullWaits++;
+        r->stats.fullSeconds += sleepUntil(r, hasRoom, NULL);
+    }
+    if (atomic_load(&r->aborted)) {
+        return NULL;
+    }
+    return r->data + (size_t) (atomic_load_explicit(&r->head, memory_order_relaxed) % r->count) * r->size;
+}
+
+void ringPublish(PacketRing *r, int size, long long tag) {
+    long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->entries[head % r->count].size = size;
+    r->entries[head % r->count].tag = tag;
+    atomic_store(&r->head, head + 1);   //Releases the buffer and its entry to the consumer
+    int queued = head + 1 - atomic_load(&r->tail);
+    if (queued > r->stats.peak) {
+        r->stats.peak = queued;
+    }
+    r->stats.buffers++;
+    wakeSleepers(r);
+}
+
+void ringClose(PacketRing *r) {
+    atomic_store(&r->closed, 1);
+    wakeSleepers(r);
+}
+
+static int closedAndEmpty(PacketRing *r, long long tail) {
+    //closed first: the producer queues its last packets before closing, so a head loaded
+    //after seeing closed includes them
+    return atomic_load_explicit(&r->closed, memory_order_acquire)
+        && atomic_load_explicit(&r->head, memory_order_acquire) == tail;
+}
+
+static unsigned char *peek(PacketRing *r, int *size, long long *tag, const struct timespec *deadline) {
+    long long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (atomic_load(&r->head) == tail) {
+        if (closedAndEmpty(r, tail)) {
+            return NULL;
+        }
+        if (atomic_load(&r->head) == tail) {
+            r->stats.emptyWaits++;
+            r->stats.emptySeconds += sleepUntil(r, hasPacket, deadline);
+            if (atomic_load(&r->head) == tail) {
+                return NULL;    //Closed or timed out while waiting
+            }
+        }
+    }
+    *size = r->entries[tail % r->count].size;
+    if (tag != NULL) {
+        *tag = r->entries[tail % r->count].tag;
+    }
+    return r->data + (size_t) (tail % r->count) * r->size;
+}
+
+unsigned char *ringPeek(PacketRing *r, int *size, long long *tag) {
+    return peek(r, size, tag, NULL);
+}
+
+unsigned char *ringPeekTimed(PacketRing *r, int *size, long long *tag, int timeoutMs, int *timedOut) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    unsigned char *data = peek(r, size, tag, &deadline);
+    *timedOut = data == NULL && !closedAndEmpty(r, atomic_load_explicit(&r->tail, memory_order_relaxed));
+    return data;
+}
+
+void ringRelease(PacketRing *r) {
+    atomic_store(&r->tail, atomic_load_explicit(&r->tail, memory_order_relaxed) + 1);
+    wakeSleepers(r);
+}
+
+void ringAbort(PacketRing *r) {
+    atomic_store(&r->aborted, 1);
+    wakeSleepers(r);
+}
+
+void freeRing(PacketRing *r, RingStatistics *stats) {
+    if (stats != NULL) {
+        *stats = r->stats;
+    }
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    free(r->data);
+    free(r->entries);
+    free(r);
+}
@@ -0,0 +1,52 @@
+// Line speed through the termios2 ioctls, which take the rate as a plain integer
+// next to the Bxxx code. <asm/termbits.h> clashes with <termios.h>, hence its own file.
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include "serial_port.h"
+
+static const struct {
+    int rate;
+    int constant;
+} rates[] = {
+    {50, B50}, {75, B75}, {110, B110}, {134, B134}, {150, B150}, {200, B200},
+    {300, B300}, {600, B600}, {1200, B1200}, {1800, B1800}, {2400, B2400},
+    {4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400},
+    {57600, B57600}, {115200, B115200}, {230400, B230400}, {460800, B460800},
+    {500000, B500000}, {576000, B576000}, {921600, B921600}, {1000000, B1000000},
+    {1152000, B1152000}, {1500000, B1500000}, {2000000, B2000000},
+    {2500000, B2500000}, {3000000, B3000000}, {3500000, B3500000},
+    {4000000, B4000000},
+};
+
+int baudConstant(int baudRate) {
+    for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (rates[i].rate == baudRate) {
+            return rates[i].constant;
+        }
+    }
+    return -1;
+}
+
+int setBaudRate(int fd, int baudRate) {
+    if (baudRate <= 0) {
+        return -1;
+    }
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        return -1;
+    }
+    int constant = baudConstant(baudRate);
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));   //Input speed follows the output one
+    tio.c_cflag |= constant >= 0 ? (unsigned) constant : BOTHER;
+    tio.c_ispeed = baudRate;
+    tio.c_ospeed = baudRate;
+    if (ioctl(fd, TCSETS2, &tio) == -1) {
+        return -1;
+    }
+    //Drivers round to what the hardware divisor can do
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        return -1;
+    }
+    return tio.c_ospeed;
+}
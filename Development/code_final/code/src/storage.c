@@ -0,0 +1,200 @@
+// Receiver storage: a packet ring of block buffers between the link thread and one writer
+// thread. The link thread fills the buffer it reserved and queues it, the writer takes the
+// buffers in turn, so blocks reach the file in the order they were received.
+// A buffer left filling when the link goes quiet is queued by the writer once it is old
+// enough; the lock keeps that from overlapping storeAt().
+
+#define _GNU_SOURCE     // fallocate()
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "packet_ring.h"
+#include "storage.h"
+
+#define STORAGE_ALIGNMENT 4096
+
+struct Storage {
+    int fd;
+    int policy;
+    StoredCallback stored;
+    void *context;
+    PacketRing *ring;
+    pthread_mutex_t lock;       //Held by storeAt() and by the writer to queue an old buffer
+    unsigned char *filling;     //The reserved buffer, NULL if none
+    long long fillingOffset;    //Where it goes in the file
+    int fillingSize;
+    int fillingLimit;           //Bytes left to the block boundary when the buffer was started
+    struct timespec fillingSince;
+    pthread_t thread;
+    int started;
+    int failed;                 //Set by the writer, read by the link thread after the join
+    StorageStatistics stats;
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int writeBuffer(Storage *s, const unsigned char *data, int size, long long offset) {
+    for (int done = 0; done < size;) {
+        ssize_t n = pwrite(s->fd, data + done, size - done, offset + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+        s->stats.writes++;
+    }
+    if (s->policy == SYNC_BLOCK) {
+        s->stats.syncs++;
+        return fdatasync(s->fd);
+    }
+    return 0;
+}
+
+static void queueFilling(Storage *s) {
+    ringPublish(s->ring, s->fillingSize, s->fillingOffset);
+    s->filling = NULL;
+}
+
+static int queueIfOld(Storage *s) {
+    //Writer: queues the buffer being filled once it is STORAGE_MAX_AGE_MS old.
+    //Returns how long to wait before looking again, in milliseconds.
+    if (pthread_mutex_trylock(&s->lock) != 0) {
+        return STORAGE_MAX_AGE_MS / 10;     //storeAt() is running and checks the age itself
+    }
+    int wait = STORAGE_MAX_AGE_MS;
+    if (s->filling != NULL && s->fillingSize > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int age = elapsed(&s->fillingSince, &now) * 1000;
+        if (age >= STORAGE_MAX_AGE_MS) {
+            queueFilling(s);
+        }
+        else {
+            wait = STORAGE_MAX_AGE_MS - age;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return wait;
+}
+
+static void *writer(void *argument) {
+    //The statistics other than stallSeconds belong to this thread until it is joined
+    Storage *s = argument;
+    unsigned char *data;
+    int size;
+    long long offset;
+    int wait = STORAGE_MAX_AGE_MS;
+    int timedOut;
+    while ((data = ringPeekTimed(s->ring, &size, &offset, wait, &timedOut)) != NULL || timedOut) {
+        if (data == NULL) {
+            wait = queueIfOld(s);
+            continue;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = writeBuffer(s, data, size, offset);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        s->stats.writerSeconds += elapsed(&start, &end);
+        if (result != 0) {
+            s->failed = 1;
+            ringAbort(s->ring);     //storeAt() fails from its next buffer on
+            break;
+        }
+        s->stats.bytes += size;
+        if (s->stored != NULL) {
+            s->stored(s->context, data, size, offset);
+        }
+        ringRelease(s->ring);
+    }
+    return NULL;
+}
+
+Storage *openStorage(int fd, long long fileSize, int policy, int buffers, StoredCallback stored, void *context) {
+    Storage *s = calloc(1, sizeof(Storage));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->fd = fd;
+    s->policy = policy;
+    s->stored = stored;
+    s->context = context;
+    pthread_mutex_init(&s->lock, NULL);
+    s->ring = createRing(buffers > 1 ? buffers : 2, STORAGE_BLOCK_SIZE, STORAGE_ALIGNMENT);
+    if (s->ring == NULL || pthread_create(&s->thread, NULL, writer, s) != 0) {
+        closeStorage(s, NULL);
+        return NULL;
+    }
+    s->started = 1;
+    //The blocks are reserved up front, so the file does not fragment as it grows and a full
+    //disk shows now rather than halfway. The size still follows what was written.
+    s->stats.preallocated = fileSize > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, fileSize) == 0;
+    return s;
+}
+
+int storeAt(Storage *s, const unsigned char *data, int size, long long offset) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&s->lock);
+    while (size > 0) {
+        if (s->filling != NULL && (offset != s->fillingOffset + s->fillingSize
+                                   || elapsed(&s->fillingSince, &now) * 1000 >= STORAGE_MAX_AGE_MS)) {
+            queueFilling(s);
+        }
+        if (s->filling == NULL) {
+            //Waits while every buffer is queued: the link slows down to the disk
+            if ((s->filling = ringReserve(s->ring)) == NULL) {
+                pthread_mutex_unlock(&s->lock);
+                return -1;
+            }
+            s->fillingOffset = offset;
+            s->fillingSize = 0;
+            s->fillingLimit = STORAGE_BLOCK_SIZE - offset % STORAGE_BLOCK_SIZE;
+            s->fillingSince = now;
+        }
+        int n = s->fillingLimit - s->fillingSize < size ? s->fillingLimit - s->fillingSize : size;
+        memcpy(s->filling + s->fillingSize, data, n);
+        s->fillingSize += n;
+        data += n;
+        size -= n;
+        offset += n;
+        if (s->fillingSize == s->fillingLimit) {
+            queueFilling(s);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+int closeStorage(Storage *s, StorageStatistics *stats) {
+    if (s->ring != NULL) {
+        pthread_mutex_lock(&s->lock);
+        if (s->filling != NULL) {
+            queueFilling(s);
+        }
+        pthread_mutex_unlock(&s->lock);
+        ringClose(s->ring);
+    }
+    if (s->started) {
+        pthread_join(s->thread, NULL);
+    }
+    if (s->policy == SYNC_END && !s->failed) {
+        s->stats.syncs++;
+        s->failed = fdatasync(s->fd) != 0;
+    }
+    int result = s->failed ? -1 : 0;
+    if (s->ring != NULL) {
+        RingStatistics ring;
+        freeRing(s->ring, &ring);
+        s->stats.stallSeconds = ring.fullSeconds;
+    }
+    if (stats != NULL) {
+        *stats = s->stats;
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    return result;
+}
@@ -0,0 +1,52 @@
+// Mask search for payload whitening. Clean payloads are ruled out with memchr(),
+// the others take one histogram pass, and masking runs a word at a time.
+
+#include <stdint.h>
+#include <string.h>
+#include "whiten.h"
+
+unsigned char chooseMask(const unsigned char *data, int size, unsigned char flag, unsigned char escape) {
+    if (memchr(data, flag, size) == NULL && memchr(data, escape, size) == NULL) {
+        return 0;
+    }
+    //Four tables so consecutive equal bytes do not wait on each other's increment
+    unsigned int counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+    }
+    for (; i < size; i++) {
+        counts[0][data[i]]++;
+    }
+    for (int value = 0; value < 256; value++) {
+        counts[0][value] += counts[1][value] + counts[2][value] + counts[3][value];
+    }
+    int best = 0;
+    unsigned int bestCost = counts[0][flag] + counts[0][escape];
+    for (int mask = 1; mask < 256 && bestCost > 0; mask++) {
+        unsigned int cost = counts[0][flag ^ mask] + counts[0][escape ^ mask] + (mask == flag || mask == escape);
+        if (cost < bestCost) {
+            best = mask;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+void applyMask(unsigned char *dst, const unsigned char *src, int size, unsigned char mask) {
+    uint64_t wide = mask * 0x0101010101010101ULL;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word ^= wide;
+        memcpy(dst + i, &word, 8);
+    }
+    for (; i < size; i++) {
+        dst[i] = src[i] ^ mask;
+    }
+}
@@ -0,0 +1,207 @@
+// Line rate benchmark: a pseudo-terminal pair, paced by the relay between them to the rate
+// set on the port, ten bits per byte. A pty does not throttle on its own. For each rate
+// this reports the rate read back, then the goodput of a transfer with stop-and-wait and with
+// a selective repeat window, and its share of the line.
+// The RTO learnt from the SET is shorter than a 1000-byte frame takes on a slow line, so each
+// transfer sets LL_RTO_MIN to the line time of a window of frames plus one, as a user would.
+// One thread per end, each with its own options in place of the environment.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/baud_bench tests/baud_bench.c src/fec.c src/crc.c src/byte_stuffing.c src/cobs.c src/whiten.c src/serial_port.c -Iinclude -lutil
+//	$ ./bin/baud_bench
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <pty.h>
+
+static const char *testOption(const char *name);
+#define getenv(name) testOption(name)
+#include "../src/link_layer.c"
+#undef getenv
+
+#define PACKET_SIZE 1000
+#define LINE_SECONDS 1      //Line time each transfer is sized for
+#define MIN_PACKETS 3
+#define FRAME_BYTES 1100    //A packet once framed, with room for some stuffing
+#define SR_WINDOW 4
+
+static __thread const char *const *options;     //"NAME=value" strings, NULL terminated
+
+static const char *testOption(const char *name) {
+    size_t length = strlen(name);
+    for (int i = 0; options != NULL && options[i] != NULL; i++) {
+        if (strncmp(options[i], name, length) == 0 && options[i][length] == '=') {
+            return options[i] + length + 1;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    LinkLayerRole role;
+    const char *options[5];
+    char port[50];
+    int packets;
+    int opened;
+    int lineRate;
+    int delivered;
+} End;
+
+static void *runEnd(void *arg) {
+    End *end = arg;
+    options = end->options;
+    LinkLayer parameters = {"", end->role, 9600, 10, 3};
+    strcpy(parameters.serialPort, end->port);
+    end->opened = llopen(parameters);
+    end->lineRate = lineRate;
+    if (end->opened != 1) {
+        return NULL;
+    }
+    unsigned char packet[PACKET_SIZE];
+    for (int i = 0; i < end->packets; i++) {
+        if (end->role == LlTx) {
+            memset(packet, i, sizeof(packet));
+            llwrite(packet, sizeof(packet));
+        }
+        else if (llread(packet) == PACKET_SIZE && packet[0] == (unsigned char) i) {
+            end->delivered++;
+        }
+    }
+    if (end->role == LlTx) {
+        llclose(FALSE);
+    }
+    else {
+        llread(packet);     //Answers the DISC
+    }
+    close(fd);
+    return NULL;
+}
+
+typedef struct {
+    int from;
+    int to;
+    int rate;
+    volatile int *stop;
+} Direction;
+
+static void *runDirection(void *arg) {
+    //Copies one way, holding each byte back until the line would have carried it
+    Direction *d = arg;
+    struct pollfd pfd = {d->from, POLLIN, 0};
+    unsigned char buf[256];
+    int chunk = d->rate / 10 / 1000 + 1;   //About a millisecond of line time
+    if (chunk > (int) sizeof(buf)) {
+        chunk = sizeof(buf);
+    }
+    long long lineFreeUs = 0;
+    while (!*d->stop) {
+        if (poll(&pfd, 1, 20) <= 0) {
+            continue;
+        }
+        int n = read(d->from, buf, chunk);
+        if (n <= 0) {
+            continue;
+        }
+        long long now = nowUs();
+        if (lineFreeUs < now) {
+            lineFreeUs = now;
+        }
+        lineFreeUs += n * 10 * 1000000LL / d->rate;
+        if (lineFreeUs > now) {
+            usleep(lineFreeUs - now);
+        }
+        if (write(d->to, buf, n) != n) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static int openPty(char *name, int *slave) {
+    //The slave stays open until the run is done, the master would read a hangup while no end has it open
+    int master;
+    if (openpty(&master, slave, name, NULL, NULL) != 0) {
+        perror("openpty");
+        exit(1);
+    }
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+    return master;
+}
+
+static double transfer(int rate, const char *arq, int window, int packets, int *readBack, int *delivered) {
+    //arq is the LL_ARQ value, NULL for stop-and-wait.
+    //Returns the goodput in bytes per second, from opening to the last packet delivered
+    static char baud[32];
+    static char rtoMin[32];
+    static char mode[32];
+    snprintf(baud, sizeof(baud), "LL_BAUD=%d", rate);
+    snprintf(rtoMin, sizeof(rtoMin), "LL_RTO_MIN=%lld", (window + 1) * FRAME_BYTES * 10 * 1000LL / rate + 1);
+    snprintf(mode, sizeof(mode), "LL_ARQ=%s", arq);
+    const char *arqOption = arq != NULL ? mode : NULL;
+    End ends[2] = {{LlTx, {baud, rtoMin, arqOption, NULL}}, {LlRx, {baud, rtoMin, arqOption, NULL}}};
+    int masters[2];
+    int slaves[2];
+    for (int i = 0; i < 2; i++) {
+        masters[i] = openPty(ends[i].port, &slaves[i]);
+        ends[i].packets = packets;
+    }
+    volatile int stop = 0;
+    Direction directions[2] = {{masters[0], masters[1], rate, &stop}, {masters[1], masters[0], rate, &stop}};
+    int saved = dup(STDOUT_FILENO);     //llopen() reports the port setup
+    int null = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    pthread_t threads[4];
+    pthread_create(&threads[2], NULL, runDirection, &directions[0]);
+    pthread_create(&threads[3], NULL, runDirection, &directions[1]);
+    long long start = nowUs();
+    pthread_create(&threads[1], NULL, runEnd, &ends[1]);
+    pthread_create(&threads[0], NULL, runEnd, &ends[0]);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    double elapsed = (nowUs() - start) / 1e6;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    stop = 1;
+    pthread_join(threads[2], NULL);
+    pthread_join(threads[3], NULL);
+    for (int i = 0; i < 2; i++) {
+        close(masters[i]);
+        close(slaves[i]);
+    }
+    *readBack = ends[0].lineRate;
+    *delivered = ends[1].delivered;
+    return (double) ends[1].delivered * PACKET_SIZE / elapsed;
+}
+
+int main(void) {
+    const int rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 250000, 460800, 921600, 2000000, 4000000};
+    const int count = sizeof(rates) / sizeof(rates[0]);
+    printf("%d-byte packets, about %d s of line time each, ten bits per byte\n", PACKET_SIZE, LINE_SECONDS);
+    printf("%10s %10s %8s %24s %24s\n", "rate", "read back", "packets", "stop-and-wait", "selective repeat");
+    for (int r = 0; r < count; r++) {
+        int packets = rates[r] / 10 * LINE_SECONDS / PACKET_SIZE;
+        if (packets < MIN_PACKETS) {
+            packets = MIN_PACKETS;
+        }
+        int readBack;
+        int delivered[2];
+        double goodput[2];
+        goodput[0] = transfer(rates[r], NULL, 1, packets, &readBack, &delivered[0]);
+        goodput[1] = transfer(rates[r], "sr", SR_WINDOW, packets, &readBack, &delivered[1]);
+        printf("%10d %10d %8d", rates[r], readBack, packets);
+        for (int k = 0; k < 2; k++) {
+            if (delivered[k] != packets) {
+                printf(" %15s %2d lost", "", packets - delivered[k]);
+                continue;
+            }
+            printf(" %10.0f B/s %5.1f %%", goodput[k], 100 * goodput[k] / (rates[r] / 10.0));
+        }
+        printf("\n");
+    }
+    return 0;
+}
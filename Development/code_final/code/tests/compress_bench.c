@@ -0,0 +1,98 @@
+// LZ4 benchmark: compression ratio and throughput of compressBlock() and decompressBlock()
+// at the application's packet size and larger, on the test image, on C source and on
+// random and zero bytes. Files are used as they are, blocks never span a repeat of them.
+// Run from the code directory so the files are found.
+//
+//	$ gcc -Wall -O2 -o bin/compress_bench tests/compress_bench.c -Iinclude
+//	$ ./bin/compress_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/compress.c"
+
+#define CORPUS_SIZE (256 << 10)
+#define BYTES_PER_RUN (64LL << 20)
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int load(unsigned char *buf, const char *name) {
+    //Returns the number of bytes read, up to CORPUS_SIZE, or 0 if the file cannot be read
+    FILE *file = fopen(name, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int size = fread(buf, 1, CORPUS_SIZE, file);
+    fclose(file);
+    return size > 0 ? size : 0;
+}
+
+int main(void) {
+    static unsigned char corpus[CORPUS_SIZE];
+    static unsigned char packed[CORPUS_SIZE];
+    static unsigned char plain[CORPUS_SIZE];
+    const char *corpora[] = {"penguin.gif", "src/link_layer.c", "random", "zeros"};
+    const int sizes[] = {100, 1000, 65536};
+    printf("%-18s %7s %8s %14s %14s\n", "corpus", "block", "ratio", "compress", "decompress");
+    for (int c = 0; c < 4; c++) {
+        int corpusSize = CORPUS_SIZE;
+        if (c == 2) {
+            unsigned int seed = 1;
+            for (int i = 0; i < CORPUS_SIZE; i++) {
+                seed = seed * 1103515245 + 12345;
+                corpus[i] = seed >> 16;
+            }
+        }
+        else if (c == 3) {
+            memset(corpus, 0, CORPUS_SIZE);
+        }
+        else if ((corpusSize = load(corpus, corpora[c])) == 0) {
+            printf("%-18s not found, run from the code directory\n", corpora[c]);
+            continue;
+        }
+        for (int s = 0; s < 3; s++) {
+            int size = sizes[s] < corpusSize ? sizes[s] : corpusSize;
+            int blocks = corpusSize / size;
+            //Sizes of each block once compressed, -1 where it goes as it is
+            int *packedSizes = malloc(blocks * sizeof(int));
+            long long total = 0;
+            double start = seconds();
+            long long done = 0;
+            while (done < BYTES_PER_RUN) {
+                total = 0;
+                for (int b = 0; b < blocks; b++) {
+                    packedSizes[b] = compressBlock(packed + b * size, size, corpus + b * size, size);
+                    total += packedSizes[b] >= 0 ? packedSizes[b] : size;
+                }
+                done += (long long) blocks * size;
+            }
+            double compressRate = done / (seconds() - start) / 1e6;
+            start = seconds();
+            done = 0;
+            while (done < BYTES_PER_RUN) {
+                for (int b = 0; b < blocks; b++) {
+                    if (packedSizes[b] >= 0) {
+                        decompressBlock(plain + b * size, size, packed + b * size, packedSizes[b]);
+                    }
+                    else {
+                        memcpy(plain + b * size, corpus + b * size, size);
+                    }
+                }
+                done += (long long) blocks * size;
+            }
+            double decompressRate = done / (seconds() - start) / 1e6;
+            if (memcmp(plain, corpus, (long long) blocks * size) != 0) {
+                printf("%s, %d-byte blocks: round trip differs\n", corpora[c], size);
+                return 1;
+            }
+            printf("%-18s %7d %8.3f %9.0f MB/s %9.0f MB/s\n", corpora[c], size,
+                   (double) total / ((long long) blocks * size), compressRate, decompressRate);
+            free(packedSizes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+// LZ4 test: blocks of every kind of data decompress to what was compressed, compression
+// never writes past its capacity, and truncated or corrupted blocks are either refused or
+// decoded within the output buffer, never past it. Best run once built with -fsanitize=address.
+//
+//	$ gcc -Wall -O2 -o bin/compress_test tests/compress_test.c -Iinclude
+//	$ ./bin/compress_test
+
+#include <stdio.h>
+#include "../src/compress.c"
+
+#define MAX_SIZE 70000      //Past the largest back reference offset
+#define GUARD 64
+#define GUARD_BYTE 0xa5
+
+static unsigned int seed = 4242;
+
+static unsigned int nextRandom() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void fill(unsigned char *buf, int size, int kind) {
+    //0 random, 1 zeros, 2 short repeated pattern, 3 text-like words, 4 random runs and copies
+    const char *words[] = {"frame ", "link ", "packet ", "the ", "serial ", "window ", "ack ", "\n"};
+    int i = 0;
+    while (i < size) {
+        if (kind == 0) {
+            buf[i++] = nextRandom();
+        }
+        else if (kind == 1) {
+            buf[i++] = 0;
+        }
+        else if (kind == 2) {
+            buf[i] = "abc"[i % 3];
+            i++;
+        }
+        else if (kind == 3) {
+            const char *word = words[nextRandom() % 8];
+            for (int k = 0; word[k] != '\0' && i < size; k++) {
+                buf[i++] = word[k];
+            }
+        }
+        else {
+            int run = 1 + nextRandom() % 40;
+            int back = i > 0 ? 1 + nextRandom() % i : 0;
+            for (int k = 0; k < run && i < size; k++, i++) {
+                buf[i] = back > 0 && (nextRandom() & 1) ? buf[i - back] : (unsigned char) nextRandom();
+            }
+        }
+    }
+}
+
+static int guardIntact(const unsigned char *guard) {
+    for (int i = 0; i < GUARD; i++) {
+        if (guard[i] != GUARD_BYTE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static unsigned char src[MAX_SIZE];
+static unsigned char packed[MAX_SIZE + GUARD];
+static unsigned char plain[MAX_SIZE + GUARD];
+static unsigned char damaged[MAX_SIZE];
+
+static int checkRoundTrip(int size, int kind, int *compressedSize) {
+    fill(src, size, kind);
+    memset(packed, GUARD_BYTE, sizeof(packed));
+    int packedSize = compressBlock(packed, MAX_SIZE, src, size);
+    *compressedSize = packedSize;
+    if (!guardIntact(packed + (size > 0 ? size - 1 : 0))) {
+        printf("kind %d, size %d: compression wrote past its capacity\n", kind, size);
+        return 1;
+    }
+    if (packedSize < 0) {
+        return 0;   //Not worth compressing, sent as it is
+    }
+    if (packedSize >= size) {
+        printf("kind %d, size %d: compressed to %d bytes\n", kind, size, packedSize);
+        return 1;
+    }
+    memset(plain, GUARD_BYTE, sizeof(plain));
+    if (decompressBlock(plain, size, packed, packedSize) != size || memcmp(plain, src, size) != 0
+        || !guardIntact(plain + size)) {
+        printf("kind %d, size %d: round trip differs\n", kind, size);
+        return 1;
+    }
+    if (size > 0 && decompressBlock(plain, size - 1, packed, packedSize) != -1) {
+        printf("kind %d, size %d: decompressed into a buffer one byte short\n", kind, size);
+        return 1;
+    }
+    //A smaller capacity gives up instead of overflowing
+    memset(packed, GUARD_BYTE, sizeof(packed));
+    int tight = packedSize / 2;
+    if (compressBlock(packed, tight, src, size) != -1 || !guardIntact(packed + tight)) {
+        printf("kind %d, size %d: compression into %d bytes did not give up\n", kind, size, tight);
+        return 1;
+    }
+    return 0;
+}
+
+static int checkDamage(int size, int packedSize) {
+    //packed holds a good block of size bytes. Every damaged copy must stay inside the output buffer.
+    int failures = 0;
+    for (int round = 0; round < 50; round++) {
+        memcpy(damaged, packed, packedSize);
+        int damagedSize = packedSize;
+        int how = round % 3;
+        if (how == 0) {
+            damagedSize = nextRandom() % packedSize;
+        }
+        else {
+            for (int k = 0; k < 1 + how; k++) {
+                damaged[nextRandom() % packedSize] = how == 1 ? nextRandom() : 0xff;
+            }
+        }
+        memset(plain, GUARD_BYTE, sizeof(plain));
+        int result = decompressBlock(plain, size, damaged, damagedSize);
+        if (result < -1 || result > size || !guardIntact(plain + size)) {
+            printf("size %d: damaged block decoded to %d bytes\n", size, result);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int checkMalformed() {
+    //Hand-made blocks the decoder has to refuse
+    struct {
+        const char *what;
+        unsigned char block[8];
+        int size;
+    } cases[] = {
+        {"offset 0", {0x10, 'a', 0x00, 0x00}, 4},
+        {"offset before the start", {0x10, 'a', 0x02, 0x00}, 4},
+        {"literals past the end", {0x50, 'a', 'b'}, 3},
+        {"length runs off the end", {0xf0, 0xff, 0xff}, 3},
+        {"offset cut short", {0x10, 'a', 0x01}, 3},
+        {"match past the output", {0x1f, 'a', 0x01, 0x00, 0xff, 0xff, 0x10}, 7},
+    };
+    int failures = 0;
+    for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        memset(plain, GUARD_BYTE, sizeof(plain));
+        if (decompressBlock(plain, 100, cases[i].block, cases[i].size) != -1 || !guardIntact(plain + 100)) {
+            printf("%s: accepted\n", cases[i].what);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(void) {
+    int failures = 0;
+    int cases = 0;
+    for (int kind = 0; kind < 5; kind++) {
+        for (int size = 0; size <= MAX_SIZE; size += size < 300 ? 1 : size < 5000 ? 97 : 4999) {
+            int packedSize;
+            failures += checkRoundTrip(size, kind, &packedSize);
+            if (packedSize > 0) {
+                //checkRoundTrip() left a block compressed into a tighter buffer, redo the real one
+                packedSize = compressBlock(packed, MAX_SIZE, src, size);
+                failures += checkDamage(size, packedSize);
+            }
+            cases++;
+        }
+    }
+    failures += checkMalformed();
+    printf("%d blocks, %d failures\n", cases, failures);
+    return failures != 0;
+}
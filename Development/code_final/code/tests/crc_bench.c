@@ -0,0 +1,71 @@
+// Frame check benchmark: cost per byte of BCC, CRC-16 and both CRC-32 implementations,
+// on payload-sized and larger buffers.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/crc_bench tests/crc_bench.c -Iinclude
+//	$ ./bin/crc_bench
+
+#include <stdio.h>
+#include <time.h>
+#include "../src/crc.c"
+
+#define BYTES_PER_RUN (256LL << 20)
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned int bcc(unsigned int check, const unsigned char *data, int size) {
+    //The link layer's BCC2, a XOR of the bytes
+    unsigned char result = check;
+    for (int i = 0; i < size; i++) {
+        result ^= data[i];
+    }
+    return result;
+}
+
+static unsigned int crc16(unsigned int crc, const unsigned char *data, int size) {
+    return crc16Update(crc, data, size);
+}
+
+typedef struct {
+    const char *name;
+    unsigned int (*update)(unsigned int, const unsigned char *, int);
+} Check;
+
+int main(void) {
+    pthread_once(&tablesOnce, buildTables);
+    pthread_once(&implOnce, selectCrc);
+    Check checks[4] = {{"bcc", bcc}, {"crc16", crc16}, {"crc32 slice-by-8", crc32Slice8}};
+    int count = 3;
+#ifdef CRC_X86
+    if (__builtin_cpu_supports("pclmul")) {
+        checks[count++] = (Check) {"crc32 pclmul", crc32Pclmul};
+    }
+#endif
+    static unsigned char buf[65536];
+    for (int i = 0; i < (int) sizeof(buf); i++) {
+        buf[i] = i * 131 + 7;
+    }
+    const int sizes[] = {100, 1000, 65536};
+    printf("%-18s", "bytes per call");
+    for (int s = 0; s < 3; s++) {
+        printf("  %13d", sizes[s]);
+    }
+    printf("\n");
+    for (int k = 0; k < count; k++) {
+        printf("%-18s", checks[k].name);
+        for (int s = 0; s < 3; s++) {
+            volatile unsigned int sink = 0;
+            double start = seconds();
+            for (long long done = 0; done < BYTES_PER_RUN; done += sizes[s]) {
+                sink += checks[k].update(0xffffffff, buf, sizes[s]);
+            }
+            double elapsed = seconds() - start;
+            printf("  %8.2f GB/s", BYTES_PER_RUN / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+    return 0;
+}
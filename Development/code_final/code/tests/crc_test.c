@@ -0,0 +1,68 @@
+// CRC test: the standard check values of "123456789" for CRC-16 (X.25), CRC-32 and CRC-8,
+// both CRC-32 implementations agreeing on every length and alignment, and the receiver's residue.
+// The source is included so each implementation can be called directly.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/crc_test tests/crc_test.c -Iinclude
+//	$ ./bin/crc_test
+
+#include <stdio.h>
+#include <string.h>
+#include "../src/crc.c"
+
+static int failures = 0;
+
+static void expect(const char *what, unsigned int value, unsigned int expected) {
+    if (value != expected) {
+        printf("%s: %08x, expected %08x\n", what, value, expected);
+        failures++;
+    }
+}
+
+int main(void) {
+    const unsigned char *check = (const unsigned char *) "123456789";
+    pthread_once(&tablesOnce, buildTables);
+    pthread_once(&implOnce, selectCrc);
+    expect("CRC-16", (unsigned short) ~crc16Update(CRC16_INIT, check, 9), 0x906e);
+    expect("CRC-32 slice-by-8", ~crc32Slice8(CRC32_INIT, check, 9), 0xcbf43926);
+    expect("CRC-32 dispatched", ~crc32Update(CRC32_INIT, check, 9), 0xcbf43926);
+    expect("CRC-8", crc8Update(0, check, 9), 0xf4);
+
+    static unsigned char buf[4096 + 16];
+    unsigned int seed = 7;
+    for (int i = 0; i < (int) sizeof(buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+    int cases = 0;
+    for (int size = 0; size <= 4096; size += size < 300 ? 1 : 97) {
+        for (int offset = 0; offset < 16; offset += 5) {
+            const unsigned char *data = buf + offset;
+            unsigned int slice = crc32Slice8(CRC32_INIT, data, size);
+#ifdef CRC_X86
+            if (__builtin_cpu_supports("pclmul")) {
+                expect("CRC-32 pclmul against slice-by-8", crc32Pclmul(CRC32_INIT, data, size), slice);
+            }
+#endif
+            //Byte at a time and in one call must agree, as frames are checked piece by piece
+            unsigned short crc16 = CRC16_INIT;
+            for (int i = 0; i < size; i++) {
+                crc16 = crc16Update(crc16, data + i, 1);
+            }
+            expect("CRC-16 bytewise", crc16, crc16Update(CRC16_INIT, data, size));
+            //The FCS goes out complemented, low byte first, and the receiver ends on the residue
+            unsigned char fcs[4];
+            unsigned int sent = ~slice;
+            for (int k = 0; k < 4; k++) {
+                fcs[k] = sent >> (8 * k);
+            }
+            expect("CRC-32 residue", crc32Update(crc32Update(CRC32_INIT, data, size), fcs, 4), CRC32_RESIDUE);
+            unsigned short sent16 = ~crc16;
+            fcs[0] = sent16 & 0xff;
+            fcs[1] = sent16 >> 8;
+            expect("CRC-16 residue", crc16Update(crc16, fcs, 2), CRC16_RESIDUE);
+            cases++;
+        }
+    }
+    printf("CRC-32 %s, %d buffers, %d failures\n", crcImplementation(), cases, failures);
+    return failures != 0;
+}
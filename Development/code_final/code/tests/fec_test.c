@@ -0,0 +1,106 @@
+// FEC test: interleaved Reed-Solomon blocks repair parity / 2 bad bytes in every codeword,
+// and blocks too long for 255-byte codewords are refused, by fecDecode() and by the
+// receiver before it, instead of overrunning the codeword buffer.
+// The link layer source is included so checkInfoBody() can be called directly.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/fec_test tests/fec_test.c src/fec.c src/crc.c src/byte_stuffing.c src/cobs.c src/whiten.c src/serial_port.c -Iinclude
+//	$ ./bin/fec_test
+
+#include "../src/link_layer.c"
+
+#define MAX_BLOCK (255 * FEC_MAX_DEPTH)
+
+static int failures = 0;
+
+static void expect(const char *what, int value, int expected) {
+    if (value != expected) {
+        printf("%s: %d, expected %d\n", what, value, expected);
+        failures++;
+    }
+}
+
+static unsigned int seed = 99;
+
+static unsigned int nextRandom() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static int checkRepair(int size, int parity, int depth) {
+    //parity / 2 errors in every codeword, anywhere in its data or parity bytes
+    static unsigned char block[MAX_BLOCK];
+    static unsigned char original[MAX_BLOCK];
+    for (int i = 0; i < size; i++) {
+        block[i] = nextRandom();
+    }
+    int total = size + fecEncode(block + size, block, size, parity, depth);
+    memcpy(original, block, total);
+    int damaged = 0;
+    for (int c = 0; c < depth; c++) {
+        int count = c < size ? (size - c + depth - 1) / depth : 0;
+        for (int e = 0; e < parity / 2; ) {
+            int k = nextRandom() % (count + parity);
+            int at = k < count ? c + k * depth : size + c * parity + k - count;
+            if (block[at] == original[at]) {
+                block[at] ^= 1 + nextRandom() % 255;
+                damaged++;
+                e++;
+            }
+        }
+    }
+    int corrected = fecDecode(block, size, parity, depth);
+    if (corrected != damaged || memcmp(block, original, total) != 0) {
+        printf("size %d, parity %d, depth %d: %d of %d bytes corrected\n", size, parity, depth, corrected, damaged);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    static unsigned char block[MAX_BLOCK];
+    const int parities[] = {2, 8, 32};
+    const int depths[] = {1, 4, 16};
+    int cases = 0;
+    for (int p = 0; p < 3; p++) {
+        for (int d = 0; d < 3; d++) {
+            int largest = (255 - parities[p]) * depths[d];
+            for (int size = 0; size <= largest; size += size < 20 ? 1 : 97) {
+                failures += checkRepair(size, parities[p], depths[d]);
+                cases++;
+            }
+            failures += checkRepair(largest, parities[p], depths[d]);
+            cases++;
+            //One byte more makes a codeword of 256 bytes
+            expect("oversize block", fecDecode(block, largest + 1, parities[p], depths[d]), -1);
+        }
+    }
+    expect("negative size", fecDecode(block, -1, 2, 1), -1);
+    expect("parity out of range", fecDecode(block, 10, FEC_MAX_PARITY + 1, 1), -1);
+    expect("depth out of range", fecDecode(block, 10, 2, 0), -1);
+    expect("depth out of range", fecDecode(block, 10, 2, FEC_MAX_DEPTH + 1), -1);
+    expect("1509 bytes at parity 2, depth 4", fecDecode(block, 1509, 2, 4), -1);
+
+    //The longest body that fits the agreed codewords is repaired and passes its FCS
+    static unsigned char body[MAX_BODY_SIZE + 1];
+    const unsigned char header[2] = {0x03, 0x00};
+    configureFcs(FCS_CRC16);
+    configureFec(2, 4);
+    int fitting = (255 - fecParity) * fecDepth;
+    int payload = fitting - fcsSize;
+    for (int i = 0; i < payload; i++) {
+        body[i] = nextRandom();
+    }
+    writeFcs(body + payload, updateFcs(startFcs(header), body, payload), 0);
+    int bodySize = fitting + fecEncode(body + fitting, body, fitting, fecParity, fecDepth);
+    body[7] ^= 0xff;
+    int size = 0;
+    expect("longest body", checkInfoBody(body, bodySize, 0, 0, header, &size), INFO);
+    expect("longest body size", size, payload);
+    //One byte more, up to the longest length the receiver reads, is refused before decoding
+    expect("one byte more", checkInfoBody(body, bodySize + 1, 0, 0, header, NULL), INFO_ERROR);
+    expect("longest length field", checkInfoBody(body, MAX_BODY_SIZE, 0, 0, header, NULL), INFO_ERROR);
+    printf("%d blocks, %d failures\n", cases, failures);
+    return failures != 0;
+}
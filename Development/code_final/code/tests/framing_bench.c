@@ -0,0 +1,84 @@
+// Framing benchmark: bytes on the line per payload byte, header and flags included, and
+// the cost of building the frames, for each framing mode on full 1000-byte payloads of the
+// test image, C source, random bytes and the worst case for stuffing, all FLAG bytes.
+// All modes use CRC-16, as COBS always does. Run from the code directory so the files are found.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/framing_bench tests/framing_bench.c src/fec.c src/crc.c src/byte_stuffing.c src/cobs.c src/whiten.c src/serial_port.c -Iinclude
+//	$ ./bin/framing_bench
+
+#include "../src/link_layer.c"
+
+#define CORPUS_SIZE (128 << 10)
+#define BYTES_PER_RUN (64LL << 20)
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int load(unsigned char *buf, const char *name) {
+    //Returns the number of bytes read, up to CORPUS_SIZE, or 0 if the file cannot be read
+    FILE *file = fopen(name, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int size = fread(buf, 1, CORPUS_SIZE, file);
+    fclose(file);
+    return size > 0 ? size : 0;
+}
+
+int main(void) {
+    static unsigned char corpus[CORPUS_SIZE];
+    static unsigned char frame[MAX_FRAME_SIZE];
+    const char *corpora[] = {"penguin.gif", "src/link_layer.c", "random", "all 0x7e"};
+    const char *modes[] = {"stuffing", "stuffing, whitened", "cobs", "length"};
+    const int framings[] = {FRAMING_STUFFING, FRAMING_STUFFING, FRAMING_COBS, FRAMING_LENGTH};
+    machine = TRANSMITTER;
+    printf("%d-byte payloads, line bytes per payload byte and build speed\n", MAX_PAYLOAD_SIZE);
+    printf("%-18s", "");
+    for (int m = 0; m < 4; m++) {
+        printf(" %22s", modes[m]);
+    }
+    printf("\n");
+    for (int c = 0; c < 4; c++) {
+        int corpusSize = CORPUS_SIZE;
+        if (c == 2) {
+            unsigned int seed = 1;
+            for (int i = 0; i < CORPUS_SIZE; i++) {
+                seed = seed * 1103515245 + 12345;
+                corpus[i] = seed >> 16;
+            }
+        }
+        else if (c == 3) {
+            memset(corpus, FLAG, CORPUS_SIZE);
+        }
+        else if ((corpusSize = load(corpus, corpora[c])) < MAX_PAYLOAD_SIZE) {
+            printf("%-18s not found, run from the code directory\n", corpora[c]);
+            continue;
+        }
+        int payloads = corpusSize / MAX_PAYLOAD_SIZE;
+        printf("%-18s", corpora[c]);
+        for (int m = 0; m < 4; m++) {
+            Settings settings = {STOP_AND_WAIT, 0, FCS_CRC16, 0, 1, MAX_PAYLOAD_SIZE, framings[m], m == 1, 0};
+            applySettings(&settings);
+            long long lineBytes = 0;
+            for (int p = 0; p < payloads; p++) {
+                lineBytes += buildInfoFrame(frame, 0, NULL, 0, corpus + p * MAX_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE);
+            }
+            double start = seconds();
+            long long done = 0;
+            volatile int sink = 0;
+            while (done < BYTES_PER_RUN) {
+                for (int p = 0; p < payloads; p++) {
+                    sink += buildInfoFrame(frame, 0, NULL, 0, corpus + p * MAX_PAYLOAD_SIZE, MAX_PAYLOAD_SIZE);
+                }
+                done += (long long) payloads * MAX_PAYLOAD_SIZE;
+            }
+            double rate = done / (seconds() - start) / 1e6;
+            printf("  %6.4f %8.0f MB/s", (double) lineBytes / ((long long) payloads * MAX_PAYLOAD_SIZE), rate);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,315 @@
+// SET/UA negotiation test: the parameter block round trip and merge rules, a handshake between
+// two negotiating ends, and the fallback to the plain handshake when the peer never sends a
+// parameter block, in either role. Links run on pseudo-terminals, one thread per end, each
+// with its own options in place of the environment.
+// The link layer source is included so its settings can be checked directly.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/negotiation_test tests/negotiation_test.c src/fec.c src/crc.c src/byte_stuffing.c src/cobs.c src/whiten.c src/serial_port.c -Iinclude -lutil
+//	$ ./bin/negotiation_test
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <pty.h>
+
+static const char *testOption(const char *name);
+#define getenv(name) testOption(name)
+#include "../src/link_layer.c"
+#undef getenv
+
+#define PACKETS 5
+
+static __thread const char *const *options;     //"NAME=value" strings, NULL terminated
+
+static const char *testOption(const char *name) {
+    size_t length = strlen(name);
+    for (int i = 0; options != NULL && options[i] != NULL; i++) {
+        if (strncmp(options[i], name, length) == 0 && options[i][length] == '=') {
+            return options[i] + length + 1;
+        }
+    }
+    return NULL;
+}
+
+static int failures = 0;
+
+static void expect(const char *what, int value, int expected) {
+    if (value != expected) {
+        printf("%s: %d, expected %d\n", what, value, expected);
+        failures++;
+    }
+}
+
+//----------------Parameter blocks----------------
+
+static void checkBlocks() {
+    Settings local = {GO_BACK_N, 4, FCS_CRC32, 8, 2, 600, FRAMING_COBS, 1, 0};
+    local.explicitMask = (1 << PARAM_ARQ) | (1 << PARAM_FEC_PARITY);
+    unsigned char block[MAX_ARRAY_SIZE];
+    Settings read;
+
+    readParameters(block, writeParameters(block, &local, TRUE), &read);
+    expect("round trip arq", read.arq, GO_BACK_N);
+    expect("round trip window", read.window, 4);
+    expect("round trip fcs", read.fcs, FCS_CRC32);
+    expect("round trip parity", read.fecParity, 8);
+    expect("round trip depth", read.fecDepth, 2);
+    expect("round trip payload", read.maxPayload, 600);
+    expect("round trip framing", read.framing, FRAMING_COBS);
+    expect("round trip whitening", read.whitening, 1);
+
+    //Only what the user gave goes in a SET, with the payload limit
+    int size = writeParameters(block, &local, FALSE);
+    expect("SET block size", size, 3 + 3 + 4);
+    readParameters(block, size, &read);
+    expect("SET block mask", read.explicitMask, local.explicitMask);
+    expect("SET block fcs left at default", read.fcs, FCS_BCC);
+    expect("SET block depth left at default", read.fecDepth, 1);
+
+    //Unknown types and wrong lengths are skipped, a truncated parameter ends the block
+    const unsigned char odd[] = {0x7f, 3, 1, 2, 3, PARAM_FCS, 2, FCS_CRC32, 0, PARAM_ARQ, 1, SELECTIVE_REPEAT,
+                                 PARAM_MAX_PAYLOAD, 2, 0x01, 0x00, PARAM_FEC_PARITY, 4, 8};
+    readParameters(odd, sizeof(odd), &read);
+    expect("unknown type skipped", read.arq, SELECTIVE_REPEAT);
+    expect("wrong length ignored", read.fcs, FCS_BCC);
+    expect("payload read", read.maxPayload, 256);
+    expect("truncated ignored", read.fecParity, 0);
+    expect("mask of a skipped block", read.explicitMask, 1 << PARAM_ARQ);
+}
+
+static void checkMerge() {
+    //agreed is the initiator's request, local the responder's own settings
+    Settings agreed = {SELECTIVE_REPEAT, 0, FCS_CRC16, 2, 1, 1000, FRAMING_COBS, 1,
+                       (1 << PARAM_ARQ) | (1 << PARAM_WINDOW) | (1 << PARAM_FCS) | (1 << PARAM_FRAMING) | (1 << PARAM_WHITENING)};
+    Settings local = {GO_BACK_N, 3, FCS_CRC32, 6, 4, 500, FRAMING_LENGTH, 0,
+                      (1 << PARAM_ARQ) | (1 << PARAM_WINDOW) | (1 << PARAM_FCS) | (1 << PARAM_FEC_PARITY) | (1 << PARAM_FRAMING)};
+    mergeSettings(&agreed, &local);
+    expect("both set arq, simpler wins", agreed.arq, GO_BACK_N);
+    expect("both set window, 0 is the largest", agreed.window, 3);
+    expect("both set fcs, stronger wins", agreed.fcs, FCS_CRC32);
+    expect("responder alone set parity", agreed.fecParity, 6);
+    expect("nobody set depth, responder's", agreed.fecDepth, 4);
+    expect("smaller payload", agreed.maxPayload, 500);
+    expect("different framings, stuffing", agreed.framing, FRAMING_STUFFING);
+    expect("initiator alone set whitening", agreed.whitening, 1);
+    expect("merged mask", agreed.explicitMask,
+           (1 << PARAM_ARQ) | (1 << PARAM_WINDOW) | (1 << PARAM_FCS) | (1 << PARAM_FEC_PARITY) | (1 << PARAM_FRAMING) | (1 << PARAM_WHITENING));
+}
+
+//----------------Handshakes----------------
+
+typedef struct {
+    LinkLayerRole role;
+    const char *const *options;
+    char port[50];
+    int opened;
+    int arq;
+    int fcs;
+    int fecParity;
+    int framing;
+    int peerBlock;      //Size of the parameter block in the UA the transmitter got
+    int delivered;      //Packets the receiver read back intact
+} End;
+
+static void *runEnd(void *arg) {
+    End *end = arg;
+    options = end->options;
+    LinkLayer parameters = {"", end->role, 38400, 10, 1};
+    strcpy(parameters.serialPort, end->port);
+    end->opened = llopen(parameters);
+    end->arq = arqMode;
+    end->fcs = fcsMode;
+    end->fecParity = fecParity;
+    end->framing = framingMode;
+    end->peerBlock = peerParametersSize;
+    return NULL;
+}
+
+static void *runTransfer(void *arg) {
+    //Opens, then exchanges a few packets so both ends prove to use the same settings
+    End *end = arg;
+    runEnd(end);
+    if (end->opened != 1) {
+        return NULL;
+    }
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    for (int i = 0; i < PACKETS; i++) {
+        if (end->role == LlTx) {
+            memset(packet, i, sizeof(packet));
+            llwrite(packet, 100 + i);
+        }
+        else if (llread(packet) == 100 + i && packet[0] == i && packet[99 + i] == i) {
+            end->delivered++;
+        }
+    }
+    if (end->role == LlTx) {
+        llclose(FALSE);
+    }
+    else {
+        llread(packet);     //Answers the DISC
+    }
+    close(fd);
+    return NULL;
+}
+
+typedef struct {
+    int masters[2];
+    volatile int stop;
+} Relay;
+
+static void *runRelay(void *arg) {
+    //Connects two pseudo-terminals as a null-modem cable would
+    Relay *relay = arg;
+    struct pollfd fds[2] = {{relay->masters[0], POLLIN, 0}, {relay->masters[1], POLLIN, 0}};
+    unsigned char buf[4096];
+    while (!relay->stop) {
+        if (poll(fds, 2, 20) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents & POLLIN) {
+                int n = read(fds[i].fd, buf, sizeof(buf));
+                if (n > 0 && write(fds[1 - i].fd, buf, n) != n) {
+                    return NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static int openPty(char *name, int *slave) {
+    //The slave stays open until the test is done, the master would read a hangup while no end has it open
+    int master;
+    if (openpty(&master, slave, name, NULL, NULL) != 0) {
+        perror("openpty");
+        exit(1);
+    }
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+    return master;
+}
+
+static void checkNegotiated() {
+    static const char *const txOptions[] = {"LL_ARQ=gbn", "LL_FCS=crc32", NULL};
+    static const char *const rxOptions[] = {"LL_ARQ=sr", "LL_FEC=4", "LL_FRAMING=cobs", NULL};
+    End ends[2] = {{LlTx, txOptions}, {LlRx, rxOptions}};
+    Relay relay;
+    int slaves[2];
+    relay.masters[0] = openPty(ends[0].port, &slaves[0]);
+    relay.masters[1] = openPty(ends[1].port, &slaves[1]);
+    relay.stop = 0;
+    pthread_t threads[3];
+    pthread_create(&threads[2], NULL, runRelay, &relay);
+    pthread_create(&threads[1], NULL, runTransfer, &ends[1]);
+    pthread_create(&threads[0], NULL, runTransfer, &ends[0]);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    relay.stop = 1;
+    pthread_join(threads[2], NULL);
+    for (int i = 0; i < 2; i++) {
+        const char *name = i == 0 ? "negotiated transmitter" : "negotiated receiver";
+        printf("%s: arq %d, fcs %d, parity %d, framing %d\n", name, ends[i].arq, ends[i].fcs, ends[i].fecParity, ends[i].framing);
+        expect("opened", ends[i].opened, 1);
+        expect("arq, both asked, the simpler", ends[i].arq, GO_BACK_N);
+        expect("fcs, transmitter asked", ends[i].fcs, FCS_CRC32);
+        expect("parity, receiver asked", ends[i].fecParity, 4);
+        expect("framing, receiver asked", ends[i].framing, FRAMING_COBS);
+        close(relay.masters[i]);
+        close(slaves[i]);
+    }
+    expect("UA parameter block", ends[0].peerBlock > 0, 1);
+    expect("packets delivered", ends[1].delivered, PACKETS);
+}
+
+static int readFrame(int master, unsigned char *frame) {
+    //Bytes between two flags, stuffing left in place. Returns the size, or -1 after 3 s without one.
+    int size = 0;
+    unsigned char byte;
+    struct pollfd pfd = {master, POLLIN, 0};
+    while (poll(&pfd, 1, 3000) > 0 && read(master, &byte, 1) == 1) {
+        if (byte != FLAG) {
+            if (size < MAX_ARRAY_SIZE) {
+                frame[size++] = byte;
+            }
+        }
+        else if (size > 0) {
+            return size;
+        }
+    }
+    return -1;
+}
+
+static void checkPlainPeerOfTransmitter() {
+    //A peer that only knows the plain SET: extended ones go unanswered
+    static const char *const txOptions[] = {"LL_FCS=crc16", "LL_RTO_MAX=100", NULL};
+    End end = {LlTx, txOptions};
+    int slave;
+    int master = openPty(end.port, &slave);
+    pthread_t thread;
+    pthread_create(&thread, NULL, runEnd, &end);
+    unsigned char frame[MAX_ARRAY_SIZE];
+    int extended = 0;
+    int plain = 0;
+    int size;
+    while (plain == 0 && (size = readFrame(master, frame)) > 0) {
+        if (size < 3 || frame[0] != A_TRANSMITTER_COMMAND || frame[1] != CNTRL_SET) {
+            continue;
+        }
+        if (size > 3) {
+            extended++;
+            continue;
+        }
+        plain++;
+        const unsigned char ua[] = {FLAG, A_TRANSMITTER_COMMAND, CNTRL_UA, A_TRANSMITTER_COMMAND ^ CNTRL_UA, FLAG};
+        if (write(master, ua, sizeof(ua)) != sizeof(ua)) {
+            break;
+        }
+    }
+    pthread_join(thread, NULL);
+    close(master);
+    close(slave);
+    printf("plain peer of the transmitter: %d extended SETs, then %d plain\n", extended, plain);
+    expect("extended SETs before falling back", extended, NEGOTIATION_ATTEMPTS);
+    expect("plain SET", plain, 1);
+    expect("opened", end.opened, 1);
+    expect("no parameter block", end.peerBlock, 0);
+    expect("own fcs kept", end.fcs, FCS_CRC16);
+}
+
+static void checkPlainPeerOfReceiver() {
+    //A peer that only sends the plain SET gets a plain UA, and the receiver keeps its own settings
+    static const char *const rxOptions[] = {"LL_FCS=crc32", "LL_ARQ=gbn", NULL};
+    End end = {LlRx, rxOptions};
+    int slave;
+    int master = openPty(end.port, &slave);
+    pthread_t thread;
+    pthread_create(&thread, NULL, runEnd, &end);
+    usleep(100000);     //llopen() flushes the line before listening
+    const unsigned char set[] = {FLAG, A_TRANSMITTER_COMMAND, CNTRL_SET, A_TRANSMITTER_COMMAND ^ CNTRL_SET, FLAG};
+    unsigned char frame[MAX_ARRAY_SIZE];
+    int size = -1;
+    if (write(master, set, sizeof(set)) == sizeof(set)) {
+        size = readFrame(master, frame);
+    }
+    pthread_join(thread, NULL);
+    close(master);
+    close(slave);
+    expect("opened", end.opened, 1);
+    expect("plain UA size", size, 3);
+    expect("UA control", size == 3 ? frame[1] : -1, CNTRL_UA);
+    expect("own fcs kept", end.fcs, FCS_CRC32);
+    expect("own arq kept", end.arq, GO_BACK_N);
+}
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    checkBlocks();
+    checkMerge();
+    checkNegotiated();
+    checkPlainPeerOfTransmitter();
+    checkPlainPeerOfReceiver();
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,80 @@
+// Packet ring test: the producer closes the ring right after its last push, and the
+// consumer must still get every packet, waiting without a limit or with short timeouts.
+// An empty ring that stays open times out, an empty closed one does not.
+//
+//	$ gcc -Wall -pthread -o bin/packet_ring_test tests/packet_ring_test.c src/packet_ring.c -Iinclude
+//	$ ./bin/packet_ring_test
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "packet_ring.h"
+
+#define RUNS 20000
+#define PACKETS 3
+
+static void *produce(void *arg) {
+    PacketRing *ring = arg;
+    for (int i = 0; i < PACKETS; i++) {
+        unsigned char *buf = ringReserve(ring);
+        if (buf == NULL) {
+            return NULL;
+        }
+        memset(buf, i, 16);
+        ringPublish(ring, 16, i);
+    }
+    ringClose(ring);
+    return NULL;
+}
+
+int main(void) {
+    int failures = 0;
+    for (int run = 0; run < RUNS; run++) {
+        PacketRing *ring = createRing(4, 16, sizeof(void *));
+        if (ring == NULL) {
+            printf("createRing failed\n");
+            return 1;
+        }
+        pthread_t producer;
+        pthread_create(&producer, NULL, produce, ring);
+        int received = 0;
+        int size;
+        long long tag;
+        unsigned char *buf;
+        int timedOut = 0;
+        //Odd runs wait 1 ms at a time, so timeouts race with the pushes and the close
+        while ((buf = run % 2 ? ringPeekTimed(ring, &size, &tag, 1, &timedOut) : ringPeek(ring, &size, &tag)) != NULL
+               || timedOut) {
+            if (buf == NULL) {
+                continue;
+            }
+            if (tag != received || size != 16 || buf[0] != received) {
+                printf("run %d: packet %d out of order\n", run, received);
+                failures++;
+            }
+            received++;
+            ringRelease(ring);
+        }
+        pthread_join(producer, NULL);
+        freeRing(ring, NULL);
+        if (received != PACKETS) {
+            printf("run %d: %d of %d packets received\n", run, received, PACKETS);
+            failures++;
+        }
+    }
+    PacketRing *ring = createRing(2, 16, sizeof(void *));
+    int size;
+    int timedOut = 0;
+    if (ringPeekTimed(ring, &size, NULL, 20, &timedOut) != NULL || !timedOut) {
+        printf("an empty ring did not time out\n");
+        failures++;
+    }
+    ringClose(ring);
+    if (ringPeekTimed(ring, &size, NULL, 20, &timedOut) != NULL || timedOut) {
+        printf("an empty closed ring timed out\n");
+        failures++;
+    }
+    freeRing(ring, NULL);
+    printf("%d runs, %d failures\n", RUNS, failures);
+    return failures != 0;
+}
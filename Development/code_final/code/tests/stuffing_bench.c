@@ -0,0 +1,93 @@
+// Byte stuffing benchmark: throughput of each implementation on 1000-byte buffers,
+// stuffing and destuffing in place.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/stuffing_bench tests/stuffing_bench.c -Iinclude
+//	$ ./bin/stuffing_bench
+
+#include <stdio.h>
+#include <time.h>
+#include "../src/byte_stuffing.c"
+
+#define SIZE 1000
+#define BYTES_PER_RUN (256LL << 20)
+
+typedef struct {
+    const char *name;
+    int (*stuff)(unsigned char *, const unsigned char *, int, unsigned char *);
+    int (*destuff)(unsigned char *, const unsigned char *, int, unsigned char *);
+} Implementation;
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *buf, const char *corpus) {
+    unsigned int seed = 1;
+    for (int i = 0; i < SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+        if (strcmp(corpus, "all-clean") == 0 && (buf[i] == STUFF_FLAG || buf[i] == STUFF_ESCAPE)) {
+            buf[i] = 0;
+        }
+        else if (strcmp(corpus, "all-0x7e") == 0) {
+            buf[i] = STUFF_FLAG;
+        }
+    }
+}
+
+int main(void) {
+    Implementation list[3] = {{"scalar", stuffScalar, destuffScalar}};
+    int count = 1;
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        list[count++] = (Implementation) {"sse2", stuffSse2, destuffSse2};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        list[count++] = (Implementation) {"avx2", stuffAvx2, destuffAvx2};
+    }
+#endif
+    const char *corpora[] = {"random", "all-clean", "all-0x7e"};
+    static unsigned char src[SIZE];
+    static unsigned char dst[2 * SIZE];
+    printf("Stuffing, %d-byte buffers, GB/s of input\n", SIZE);
+    for (int c = 0; c < 3; c++) {
+        fill(src, corpora[c]);
+        printf("  %-10s", corpora[c]);
+        for (int k = 0; k < count; k++) {
+            volatile int sink = 0;
+            unsigned char bcc;
+            double start = seconds();
+            for (long long done = 0; done < BYTES_PER_RUN; done += SIZE) {
+                sink += list[k].stuff(dst, src, SIZE, &bcc);
+            }
+            double elapsed = seconds() - start;
+            printf("  %s %6.2f", list[k].name, BYTES_PER_RUN / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+    static unsigned char stuffed[2 * SIZE];
+    printf("Destuffing in place, GB/s of output\n");
+    for (int c = 0; c < 3; c++) {
+        fill(src, corpora[c]);
+        unsigned char bcc;
+        int stuffedSize = stuffScalar(stuffed, src, SIZE, &bcc);
+        printf("  %-10s", corpora[c]);
+        for (int k = 0; k < count; k++) {
+            volatile int sink = 0;
+            double start = seconds();
+            for (long long done = 0; done < BYTES_PER_RUN; done += SIZE) {
+                //Destuffing in place overwrites the input, so each run starts from a fresh copy
+                memcpy(dst, stuffed, stuffedSize);
+                unsigned char check = 0;
+                sink += list[k].destuff(dst, dst, stuffedSize, &check);
+            }
+            double elapsed = seconds() - start;
+            printf("  %s %6.2f", list[k].name, BYTES_PER_RUN / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Byte stuffing test: the scalar, SSE2 and AVX2 encoders and decoders must agree byte for byte,
+// on random, clean and FLAG/ESCAPE-dense buffers of every length around the block sizes.
+// The source is included so each implementation can be called directly.
+//
+//	$ gcc -Wall -O2 -pthread -o bin/stuffing_test tests/stuffing_test.c -Iinclude
+//	$ ./bin/stuffing_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/byte_stuffing.c"
+
+#define MAX_SIZE 1100
+
+typedef struct {
+    const char *name;
+    int (*stuff)(unsigned char *, const unsigned char *, int, unsigned char *);
+    int (*destuff)(unsigned char *, const unsigned char *, int, unsigned char *);
+} Implementation;
+
+static unsigned int seed = 12345;
+
+static unsigned int nextRandom() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void fill(unsigned char *buf, int size, int kind) {
+    //0 random, 1 clean, 2 half FLAG/ESCAPE, 3 all FLAG, 4 all ESCAPE
+    for (int i = 0; i < size; i++) {
+        unsigned char byte = nextRandom();
+        if (kind == 1 && (byte == STUFF_FLAG || byte == STUFF_ESCAPE)) {
+            byte = 0;
+        }
+        else if (kind == 2 && (nextRandom() & 1)) {
+            byte = nextRandom() & 1 ? STUFF_FLAG : STUFF_ESCAPE;
+        }
+        else if (kind == 3) {
+            byte = STUFF_FLAG;
+        }
+        else if (kind == 4) {
+            byte = STUFF_ESCAPE;
+        }
+        buf[i] = byte;
+    }
+}
+
+static int implementations(Implementation *list) {
+    int count = 0;
+    list[count++] = (Implementation) {"scalar", stuffScalar, destuffScalar};
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        list[count++] = (Implementation) {"sse2", stuffSse2, destuffSse2};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        list[count++] = (Implementation) {"avx2", stuffAvx2, destuffAvx2};
+    }
+#endif
+    return count;
+}
+
+static int checkLength(const Implementation *list, int count, const unsigned char *src, int size) {
+    //Returns the number of mismatches
+    static unsigned char expected[2 * MAX_SIZE];
+    static unsigned char stuffed[2 * MAX_SIZE];
+    static unsigned char plain[2 * MAX_SIZE];
+    unsigned char expectedBcc;
+    int expectedSize = stuffScalar(expected, src, size, &expectedBcc);
+    int failures = 0;
+    for (int k = 0; k < count; k++) {
+        unsigned char bcc;
+        int stuffedSize = list[k].stuff(stuffed, src, size, &bcc);
+        if (stuffedSize != expectedSize || bcc != expectedBcc || memcmp(stuffed, expected, expectedSize) != 0) {
+            printf("%s stuffing differs at length %d\n", list[k].name, size);
+            failures++;
+            continue;
+        }
+        unsigned char check = 0;
+        int plainSize = list[k].destuff(plain, stuffed, stuffedSize, &check);
+        if (plainSize != size || check != expectedBcc || memcmp(plain, src, size) != 0) {
+            printf("%s destuffing differs at length %d\n", list[k].name, size);
+            failures++;
+        }
+        //Chunked, split at a random point, and in place through the dispatched entry points
+        stuffImpl = list[k].stuff;
+        destuffImpl = list[k].destuff;
+        int split = stuffedSize > 0 ? nextRandom() % (stuffedSize + 1) : 0;
+        int pending = 0;
+        check = 0;
+        int first = destuffChunk(plain, stuffed, split, &pending, &check);
+        int second = first < 0 ? -1 : destuffChunk(plain + first, stuffed + split, stuffedSize - split, &pending, &check);
+        if (first < 0 || second < 0 || pending || first + second != size || check != expectedBcc
+            || memcmp(plain, src, size) != 0) {
+            printf("%s chunked destuffing differs at length %d, split %d\n", list[k].name, size, split);
+            failures++;
+        }
+        memcpy(plain, stuffed, stuffedSize);
+        if (destuffBytes(plain, stuffedSize) != size || memcmp(plain, src, size) != 0) {
+            printf("%s in-place destuffing differs at length %d\n", list[k].name, size);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int checkInvalid(const Implementation *list, int count) {
+    //A broken escape sequence anywhere in a block is rejected by every implementation
+    static unsigned char buf[MAX_SIZE];
+    static unsigned char out[MAX_SIZE];
+    int failures = 0;
+    for (int size = 1; size <= 100; size++) {
+        for (int bad = 0; bad < 3; bad++) {
+            fill(buf, size, 1);
+            int at = nextRandom() % size;
+            buf[at] = STUFF_ESCAPE;
+            if (at + 1 < size) {
+                buf[at + 1] = bad == 0 ? 0x00 : bad == 1 ? STUFF_FLAG : STUFF_ESCAPE;
+            }
+            for (int k = 0; k < count; k++) {
+                unsigned char check = 0;
+                if (list[k].destuff(out, buf, size, &check) != -1) {
+                    printf("%s accepted a broken escape at %d of %d\n", list[k].name, at, size);
+                    failures++;
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+int main(void) {
+    Implementation list[3];
+    pthread_once(&selectOnce, selectStuffing);
+    int count = implementations(list);
+    static unsigned char src[MAX_SIZE];
+    int failures = 0;
+    int cases = 0;
+    for (int kind = 0; kind < 5; kind++) {
+        for (int size = 0; size <= 200; size++) {
+            fill(src, size, kind);
+            failures += checkLength(list, count, src, size);
+            cases++;
+        }
+        for (int round = 0; round < 200; round++) {
+            int size = 200 + nextRandom() % (MAX_SIZE - 200);
+            fill(src, size, kind);
+            failures += checkLength(list, count, src, size);
+            cases++;
+        }
+    }
+    failures += checkInvalid(list, count);
+    printf("%d implementations, %d buffers, %d failures\n", count, cases, failures);
+    return failures != 0;
+}